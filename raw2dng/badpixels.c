@@ -0,0 +1,259 @@
+/**
+ * Sparse bad pixel map
+ *
+ * Hot pixels (from dark frames) and dead or weak pixels (from gain frames)
+ * are identified once, during calibration, and stored as a list of
+ * coordinates (badpixels-xN.txt). Regular images only touch these pixels,
+ * either by interpolating them, or by listing them in the DNG
+ * (FixBadPixelsList opcode), so the raw processor can fix them.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "wirth.h"
+#include "badpixels.h"
+#include "parallel.h"
+
+#define FAIL(fmt,...) { fprintf(stderr, "Error: "); fprintf(stderr, fmt, ## __VA_ARGS__); fprintf(stderr, "\n"); exit(1); }
+#define CHECK(ok, fmt,...) { if (!(ok)) FAIL(fmt, ## __VA_ARGS__); }
+
+#define ABS(a) \
+   ({ __typeof__ (a) _a = (a); \
+     _a > 0 ? _a : -_a; })
+
+/* black columns (left and right) are not checked */
+#define BLACK_COLUMNS 8
+
+/* neighbours from the same color channel */
+static const int nx[8] = { -2,  0,  2, -2, 2, -2, 0, 2 };
+static const int ny[8] = { -2, -2, -2,  0, 0,  2, 2, 2 };
+
+static void list_append(struct bad_pixel_list * list, int * allocated, int x, int y, int flags)
+{
+    if (list->count == *allocated)
+    {
+        *allocated = (*allocated) ? (*allocated) * 2 : 1024;
+        list->pixels = realloc(list->pixels, (*allocated) * sizeof(list->pixels[0]));
+        CHECK(list->pixels, "realloc");
+    }
+
+    struct bad_pixel * p = &list->pixels[list->count++];
+    p->x = x;
+    p->y = y;
+    p->flags = flags;
+}
+
+static int compare_pos(int x1, int y1, int x2, int y2)
+{
+    return (y1 != y2) ? y1 - y2 : x1 - x2;
+}
+
+void badpix_find(struct bad_pixel_list * list, int32_t * frame, int w, int h, int flag, int thr)
+{
+    /* pixels flagged by this frame, in raster order */
+    struct bad_pixel_list found = {0};
+    int allocated = 0;
+
+    for (int y = 2; y < h - 2; y++)
+    {
+        for (int x = BLACK_COLUMNS + 2; x < w - BLACK_COLUMNS - 2; x++)
+        {
+            int neighbours[8];
+            for (int j = 0; j < 8; j++)
+            {
+                neighbours[j] = frame[x + nx[j] + (y + ny[j]) * w];
+            }
+
+            int p = frame[x + y*w];
+            int med = median_int_wirth(neighbours, 8);
+            int bad = (flag == BADPIX_GAIN)
+                ? (int64_t) ABS(p - med) * 100 > (int64_t) thr * med
+                : ABS(p - med) > thr;
+
+            if (bad)
+            {
+                list_append(&found, &allocated, x, y, flag);
+            }
+        }
+    }
+
+    /* merge with the existing list, replacing the old entries from this kind of frame */
+    struct bad_pixel_list merged = {0};
+    allocated = 0;
+    int i = 0, j = 0;
+    while (i < list->count || j < found.count)
+    {
+        struct bad_pixel * a = (i < list->count) ? &list->pixels[i] : 0;
+        struct bad_pixel * b = (j < found.count) ? &found.pixels[j] : 0;
+        int cmp = (a && b) ? compare_pos(a->x, a->y, b->x, b->y) : (a ? -1 : 1);
+
+        if (cmp < 0)
+        {
+            if (a->flags & ~flag)
+            {
+                list_append(&merged, &allocated, a->x, a->y, a->flags & ~flag);
+            }
+            i++;
+        }
+        else if (cmp > 0)
+        {
+            list_append(&merged, &allocated, b->x, b->y, flag);
+            j++;
+        }
+        else
+        {
+            list_append(&merged, &allocated, a->x, a->y, (a->flags & ~flag) | flag);
+            i++; j++;
+        }
+    }
+
+    printf("Bad pixels  : %d (total %d)\n", found.count, merged.count);
+
+    badpix_free(&found);
+    badpix_free(list);
+    *list = merged;
+}
+
+int badpix_read(char * filename, struct bad_pixel_list * list, int * w, int * h)
+{
+    FILE* f = fopen(filename, "r");
+    if (!f) return 0;
+
+    int count;
+    if (fscanf(f, "# bad pixels: %d x %d, %d\n", w, h, &count) != 3)
+    {
+        fclose(f);
+        return 0;
+    }
+
+    badpix_free(list);
+    list->pixels = malloc((count ? count : 1) * sizeof(list->pixels[0]));
+    CHECK(list->pixels, "malloc");
+
+    struct bad_pixel p;
+    for (int i = 0; i < count && fscanf(f, "%d %d %d\n", &p.x, &p.y, &p.flags) == 3; i++)
+    {
+        list->pixels[list->count++] = p;
+    }
+
+    fclose(f);
+    return 1;
+}
+
+void badpix_save(char * filename, struct bad_pixel_list * list, int w, int h)
+{
+    FILE* f = fopen(filename, "w");
+    CHECK(f, "could not open %s", filename);
+
+    fprintf(f, "# bad pixels: %d x %d, %d\n", w, h, list->count);
+    for (int i = 0; i < list->count; i++)
+    {
+        struct bad_pixel * p = &list->pixels[i];
+        fprintf(f, "%d %d %d\n", p->x, p->y, p->flags);
+    }
+    fclose(f);
+}
+
+static int compare_pixels(const void * a, const void * b)
+{
+    const struct bad_pixel * pa = a;
+    const struct bad_pixel * pb = b;
+    return compare_pos(pa->x, pa->y, pb->x, pb->y);
+}
+
+void badpix_remap(struct bad_pixel_list * list, const int * row_map, const int * col_map, int w, int h)
+{
+    int n = 0;
+    for (int i = 0; i < list->count; i++)
+    {
+        struct bad_pixel p = list->pixels[i];
+        if (p.x >= 0 && p.x < w && p.y >= 0 && p.y < h && col_map[p.x] >= 0 && row_map[p.y] >= 0)
+        {
+            p.x = col_map[p.x];
+            p.y = row_map[p.y];
+            list->pixels[n++] = p;
+        }
+    }
+
+    /* Y windows may be read out of order; also merge duplicates */
+    qsort(list->pixels, n, sizeof(list->pixels[0]), compare_pixels);
+
+    list->count = 0;
+    for (int i = 0; i < n; i++)
+    {
+        struct bad_pixel * last = list->count ? &list->pixels[list->count - 1] : 0;
+        if (last && compare_pixels(last, &list->pixels[i]) == 0)
+        {
+            last->flags |= list->pixels[i].flags;
+        }
+        else
+        {
+            list->pixels[list->count++] = list->pixels[i];
+        }
+    }
+}
+
+static int is_bad(struct bad_pixel_list * list, int x, int y)
+{
+    int lo = 0, hi = list->count - 1;
+    while (lo <= hi)
+    {
+        int mid = (lo + hi) / 2;
+        int cmp = compare_pos(list->pixels[mid].x, list->pixels[mid].y, x, y);
+        if (cmp == 0) return 1;
+        if (cmp < 0) lo = mid + 1; else hi = mid - 1;
+    }
+    return 0;
+}
+
+void badpix_fix(struct bad_pixel_list * list, int16_t * raw16, int w, int h)
+{
+    /* only good pixels are read, and only bad pixels are written,
+     * so the order does not matter */
+    PARALLEL_FOR
+    for (int i = 0; i < list->count; i++)
+    {
+        int x = list->pixels[i].x;
+        int y = list->pixels[i].y;
+        int neighbours[8];
+        int n = 0;
+
+        for (int j = 0; j < 8; j++)
+        {
+            int xn = x + nx[j];
+            int yn = y + ny[j];
+            if (xn >= 0 && xn < w && yn >= 0 && yn < h && !is_bad(list, xn, yn))
+            {
+                neighbours[n++] = raw16[xn + yn*w];
+            }
+        }
+
+        if (n)
+        {
+            raw16[x + y*w] = median_int_wirth(neighbours, n);
+        }
+    }
+}
+
+void badpix_free(struct bad_pixel_list * list)
+{
+    free(list->pixels);
+    list->pixels = 0;
+    list->count = 0;
+}
@@ -0,0 +1,66 @@
+#ifndef _badpixels_h_
+#define _badpixels_h_
+
+/*
+ * Sparse bad pixel map, derived from calibration frames
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "stdint.h"
+
+/* which calibration frame flagged the pixel */
+#define BADPIX_DARK     1
+#define BADPIX_GAIN     2
+
+struct bad_pixel
+{
+    int x;
+    int y;
+    int flags;
+};
+
+/* sorted by y, then x */
+struct bad_pixel_list
+{
+    struct bad_pixel * pixels;
+    int count;
+};
+
+/* scan a calibration frame (as saved in the PGM, i.e. with offsets/scaling)
+ * and flag pixels that differ from the median of their same-color neighbours:
+ * - dark frames: by more than thr (absolute, same units as the frame)
+ * - gain frames: by more than thr (relative, in percent)
+ * Previous entries flagged by the same kind of frame are replaced. */
+void badpix_find(struct bad_pixel_list * list, int32_t * frame, int w, int h, int flag, int thr);
+
+/* text file: one "x y flags" line per pixel, full-resolution coordinates */
+/* the frame size from the file header is returned in w, h */
+int badpix_read(char * filename, struct bad_pixel_list * list, int * w, int * h);
+void badpix_save(char * filename, struct bad_pixel_list * list, int w, int h);
+
+/* convert full-resolution coordinates (w x h) to image coordinates:
+ * row_map[y] and col_map[x] are the image row and column of full-resolution pixel (x,y),
+ * or -1 if it was not read out; several pixels may end up in the same image pixel (binning) */
+void badpix_remap(struct bad_pixel_list * list, const int * row_map, const int * col_map, int w, int h);
+
+/* replace bad pixels with the median of their good same-color neighbours */
+/* only the listed pixels are visited */
+void badpix_fix(struct bad_pixel_list * list, int16_t * raw16, int w, int h);
+
+void badpix_free(struct bad_pixel_list * list);
+
+#endif
@@ -159,6 +159,44 @@ static unsigned int badpixel_opcode[] =
 };
 
 
+/* optional list of bad pixels (x,y pairs), for the FixBadPixelsList opcode */
+static int* dng_bad_pixels = 0;
+static int dng_bad_pixels_count = 0;
+static unsigned int* opcode_list1 = 0;
+
+/* the list must be sorted by rows, then by columns, and valid until save_dng */
+void dng_set_bad_pixels(int* xy, int count)
+{
+    dng_bad_pixels = xy;
+    dng_bad_pixels_count = count;
+}
+
+/* optional LinearizationTable, with black and white levels after linearization */
+static const unsigned short* dng_linearization_table = 0;
+static int dng_linearization_table_size = 0;
+static int dng_linearized_black = 0;
+static int dng_linearized_white = 0;
+
+/* the table must be valid until save_dng; size = 0 disables it */
+void dng_set_linearization_table(const unsigned short* table, int size, int black_level, int white_level)
+{
+    dng_linearization_table = table;
+    dng_linearization_table_size = size;
+    dng_linearized_black = black_level;
+    dng_linearized_white = white_level;
+}
+
+/* optional OpcodeList2 (already in big endian order), e.g. GainMap opcodes */
+static const void* dng_opcode_list2 = 0;
+static int dng_opcode_list2_size = 0;
+
+/* the data must be valid until save_dng; size = 0 disables it */
+void dng_set_opcode_list2(const void* data, int size)
+{
+    dng_opcode_list2 = data;
+    dng_opcode_list2_size = size;
+}
+
 static struct t_data_for_exif exif_data;
 
 #define BE(v)   ((v&0x000000FF)<<24)|((v&0x0000FF00)<<8)|((v&0x00FF0000)>>8)|((v&0xFF000000)>>24)   // Convert to big_endian
@@ -201,6 +239,10 @@ static int find_tag_index(struct dir_entry * ifd, int num, unsigned short tag)
 // Index of specific entries in ifd1 below.
 #define RAW_DATA_INDEX              find_tag_index(ifd1, DIR_SIZE(ifd1), 0x111)
 #define BADPIXEL_OPCODE_INDEX       find_tag_index(ifd1, DIR_SIZE(ifd1), 0xC740)
+#define OPCODE_LIST2_INDEX          find_tag_index(ifd1, DIR_SIZE(ifd1), 0xC741)
+#define LINEARIZATION_TABLE_INDEX   find_tag_index(ifd1, DIR_SIZE(ifd1), 0xC618)
+#define BLACK_LEVEL_INDEX           find_tag_index(ifd1, DIR_SIZE(ifd1), 0xC61A)
+#define WHITE_LEVEL_INDEX           find_tag_index(ifd1, DIR_SIZE(ifd1), 0xC61D)
 
 // Index of specific entries in exif_ifd below.
 #define EXPOSURE_PROGRAM_INDEX      find_tag_index(exif_ifd, DIR_SIZE(exif_ifd), 0x8822)
@@ -384,12 +426,14 @@ static void create_dng_header(struct raw_info * raw_info){
         {0x128,  T_SHORT,      1,  2},                                 // ResolutionUnit: inch
         {0x828D, T_SHORT,      2,  0x00020002},                        // CFARepeatPatternDim: Rows = 2, Cols = 2
         {0x828E, T_BYTE|T_PTR, 4,  (int)&camera_sensor.cfa_pattern},
+        {0xC618, T_SHORT|T_SKIP, 0, 0},                               // LinearizationTable (optional)
         {0xC61A, T_LONG|T_PTR, 1,  (int)&camera_sensor.black_level},   // BlackLevel
         {0xC61D, T_LONG|T_PTR, 1,  (int)&camera_sensor.white_level},   // WhiteLevel
         {0xC61F, T_LONG,       2,  (int)&camera_sensor.crop.origin},
         {0xC620, T_LONG,       2,  (int)&camera_sensor.crop.size},
         {0xC68D, T_LONG,       4,  (int)&camera_sensor.dng_active_area},
         {0xC740, T_UNDEFINED|T_PTR, sizeof(badpixel_opcode),  (int)&badpixel_opcode},
+        {0xC741, T_UNDEFINED|T_SKIP, 0, 0},                           // OpcodeList2 (optional)
     };
 
     struct dir_entry exif_ifd[]={
@@ -443,6 +487,62 @@ static void create_dng_header(struct raw_info * raw_info){
             break;
         }
 
+    if (dng_linearization_table_size)
+    {
+        ifd1[LINEARIZATION_TABLE_INDEX].type &= ~T_SKIP;
+        ifd1[LINEARIZATION_TABLE_INDEX].count = dng_linearization_table_size;
+        ifd1[LINEARIZATION_TABLE_INDEX].offset = (int)dng_linearization_table;
+
+        // black and white levels apply to linearized values
+        ifd1[BLACK_LEVEL_INDEX].type = T_LONG;
+        ifd1[BLACK_LEVEL_INDEX].offset = dng_linearized_black;
+        ifd1[WHITE_LEVEL_INDEX].type = T_LONG;
+        ifd1[WHITE_LEVEL_INDEX].offset = dng_linearized_white;
+    }
+
+    if (dng_opcode_list2_size)
+    {
+        ifd1[OPCODE_LIST2_INDEX].type &= ~T_SKIP;
+        ifd1[OPCODE_LIST2_INDEX].count = dng_opcode_list2_size;
+        ifd1[OPCODE_LIST2_INDEX].offset = (int)dng_opcode_list2;
+    }
+
+    if (dng_bad_pixels_count)
+    {
+        // FixBadPixelsConstant, followed by FixBadPixelsList
+        int n0 = sizeof(badpixel_opcode) / sizeof(badpixel_opcode[0]);
+        int n = n0 + 7 + 2 * dng_bad_pixels_count;
+        unsigned int count = dng_bad_pixels_count;
+        unsigned int length = (3 + 2 * count) * 4;
+
+        opcode_list1 = malloc(n * sizeof(opcode_list1[0]));
+        if (opcode_list1)
+        {
+            memcpy(opcode_list1, badpixel_opcode, sizeof(badpixel_opcode));
+            opcode_list1[0] = BE(2);                                // Count = 2
+
+            unsigned int* op = opcode_list1 + n0;
+            op[0] = BE(5);                                          // FixBadPixelsList = 5
+            op[1] = BE(0x01030000);                                 // DNG version = 1.3.0.0
+            op[2] = BE(1);                                          // Flags = 1
+            op[3] = BE(length);                                     // Opcode length
+            op[4] = badpixel_opcode[BADPIX_CFA_INDEX];              // BayerPhase
+            op[5] = BE(count);                                      // BadPointCount
+            op[6] = BE(0);                                          // BadRectCount
+
+            for (i = 0; i < dng_bad_pixels_count; i++)
+            {
+                unsigned int x = dng_bad_pixels[2*i];
+                unsigned int y = dng_bad_pixels[2*i+1];
+                op[7 + 2*i] = BE(y);                                // BadPoint row
+                op[8 + 2*i] = BE(x);                                // BadPoint column
+            }
+
+            ifd1[BADPIXEL_OPCODE_INDEX].offset = (int)opcode_list1;
+            ifd1[BADPIXEL_OPCODE_INDEX].count = n * sizeof(opcode_list1[0]);
+        }
+    }
+
     // filling EXIF fields
     int ifd_count = DIR_SIZE(ifd_list);
 
@@ -465,10 +565,12 @@ static void create_dng_header(struct raw_info * raw_info){
     for (j=0;j<ifd_count;j++)
     {
         raw_offset+=6; // IFD header+footer
+        ifd_list[j].count = 0;
         for(i=0; i<ifd_list[j].entry_count; i++)
         {
             if ((ifd_list[j].entry[i].type & T_SKIP) == 0)  // Exclude skipped entries (e.g. GPS info if camera doesn't have GPS)
             {
+                ifd_list[j].count++;
                 raw_offset+=12; // IFD directory entry size
                 int size_ext=get_type_size(ifd_list[j].entry[i].type)*ifd_list[j].entry[i].count;
                 if (size_ext>4) raw_offset+=size_ext+(size_ext&1);
@@ -582,6 +684,11 @@ static void free_dng_header(void)
         free(thumbnail_buf);
         thumbnail_buf = 0;
     }
+    if (opcode_list1)
+    {
+        free(opcode_list1);
+        opcode_list1 = 0;
+    }
 }
 
 //-------------------------------------------------------------------
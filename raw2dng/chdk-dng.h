@@ -37,5 +37,8 @@ void dng_set_focal(int nom, int denom);
 void dng_set_iso(int value);
 void dng_set_wbgain(int gain_r_n, int gain_r_d, int gain_g_n, int gain_g_d, int gain_b_n, int gain_b_d);
 void dng_set_datetime(char *datetime, char *subsectime);
+void dng_set_bad_pixels(int* xy, int count);
+void dng_set_opcode_list2(const void* data, int size);
+void dng_set_linearization_table(const unsigned short* table, int size, int black_level, int white_level);
 
 #endif // __CHDK_DNG_H_
@@ -48,6 +48,20 @@ static uint16_t get_bits (uint16_t in, int offset, int length) {
     return in3;
 }
 
+int metadata_get_bit_depth(uint16_t registers[128])
+{
+    switch (get_bits(registers[118], 0, 2)) {
+        case 0:
+            return 12;
+        case 1:
+            return 10;
+        case 2:
+            return 8;
+    }
+
+    return 0;
+}
+
 /* expo_reg can be:
  * 71: Exp_time
  * 73: Exp_time2,
@@ -56,19 +70,10 @@ static uint16_t get_bits (uint16_t in, int offset, int length) {
  */
 static double get_exposure(uint16_t registers[128], int expo_reg)
 {
-    double bits;
-    switch (get_bits(registers[118], 0, 2)) {
-        case 0:
-            bits = 12;
-            break;
-        case 1:
-            bits = 10;
-            break;
-        case 2:
-            bits = 8;
-            break;
-        default:
-            return 0;
+    double bits = metadata_get_bit_depth(registers);
+    if (!bits)
+    {
+        return 0;
     }
     double lvds = 250e6;
     return exposure(
@@ -85,6 +90,33 @@ double metadata_get_exposure(uint16_t registers[128])
     return get_exposure(registers, 71);
 }
 
+double metadata_get_exposure2(uint16_t registers[128])
+{
+    return get_bits(registers[70], 0, 1) ? get_exposure(registers, 73) : 0;
+}
+
+int metadata_get_plr(uint16_t registers[128], double exp_kp[2], double level[2])
+{
+    int num_slopes = registers[79];
+    if (num_slopes < 1 || num_slopes > 3)
+    {
+        num_slopes = 1;
+    }
+
+    /* knee points: remaining exposure time, and the level they clip to (if enabled) */
+    exp_kp[0] = (num_slopes >= 2) ? get_exposure(registers, 75) : 0;
+    exp_kp[1] = (num_slopes >= 3) ? get_exposure(registers, 77) : 0;
+
+    for (int i = 0; i < 2; i++)
+    {
+        int vtfl_en = (registers[106] >> (7*i)) & 0x40;
+        int vtfl    = (registers[106] >> (7*i)) & 0x3F;
+        level[i] = (vtfl_en && i < num_slopes - 1) ? (63 - vtfl) / 63.0 : 1;
+    }
+
+    return num_slopes;
+}
+
 static int get_div(uint16_t registers[128])
 {
     int pga_div = get_bits(registers[115], 3, 1);
@@ -130,6 +162,34 @@ int metadata_get_black_col(uint16_t registers[128])
     return registers[89] & (1 << 15);
 }
 
+/* Y windows (Y_start, Y_size): the first one is always used, the others only if Y_size is nonzero */
+int metadata_get_windows(uint16_t registers[128], int ystart[32], int ysize[32])
+{
+    int n = 0;
+    for (int i = 0; i < 32; i++)
+    {
+        if (i == 0 || registers[34 + i])
+        {
+            ystart[n] = registers[2 + i];
+            ysize[n]  = registers[34 + i];
+            n++;
+        }
+    }
+    return n;
+}
+
+int metadata_get_subsampling(uint16_t registers[128], int * offset, int * step)
+{
+    *offset = registers[66];
+    *step   = registers[67];
+    return get_bits(registers[68], 1, 1);
+}
+
+int metadata_get_binning(uint16_t registers[128])
+{
+    return get_bits(registers[68], 2, 1);
+}
+
 void metadata_dump_registers(uint16_t registers[128])
 {
     const char * reg_names[128] = {
@@ -260,10 +320,35 @@ void metadata_extract(uint16_t registers[128])
 {
     double exposure_ms = metadata_get_exposure(registers);
     printf("Exposure    : %g ms\n", exposure_ms);
+
+    double exposure2_ms = metadata_get_exposure2(registers);
+    if (exposure2_ms)
+    {
+        printf("Exposure 2  : %g ms (dual exposure)\n", exposure2_ms);
+    }
+
     dng_set_shutter((int)round(exposure_ms * 1000), 1000000);
 
     print_plr_settings(registers);
 
+    int ystart[32], ysize[32];
+    int num_windows = metadata_get_windows(registers, ystart, ysize);
+    if (num_windows > 1)
+    {
+        printf("Y windows   : %d\n", num_windows);
+    }
+
+    int sub_offset, sub_step;
+    if (metadata_get_subsampling(registers, &sub_offset, &sub_step))
+    {
+        printf("Subsampling : offset %d, step %d\n", sub_offset, sub_step);
+    }
+
+    if (metadata_get_binning(registers))
+    {
+        printf("Binning     : 2x2\n");
+    }
+
     int gain = metadata_get_gain(registers);
     int div = get_div(registers);
 
@@ -27,8 +27,27 @@ void metadata_dump_registers(uint16_t registers[128]);
 int metadata_get_gain(uint16_t registers[128]);
 int metadata_get_dark_offset(uint16_t registers[128]);
 double metadata_get_exposure(uint16_t registers[128]);
+
+/* Exp_time2 (registers 73-74), if interleaved dual exposure is enabled (register 70, Exp_dual); otherwise 0 */
+double metadata_get_exposure2(uint16_t registers[128]);
+
 int metadata_get_ystart(uint16_t registers[128]);
 int metadata_get_ysize(uint16_t registers[128]);
 int metadata_get_black_col(uint16_t registers[128]);
 
+/* PLR (multi-slope) exposure, registers 75-79 and 106; returns the number of slopes (1 = linear)
+ * exp_kp: exposure time (ms) remaining after each knee point (0 = not used)
+ * level: signal level each knee point clips to, as fraction of the output range (1 = no clipping) */
+int metadata_get_plr(uint16_t registers[128], double exp_kp[2], double level[2]);
+
+/* register 118 (Bit_mode): 12, 10 or 8; 0 if invalid */
+int metadata_get_bit_depth(uint16_t registers[128]);
+
+/* up to 32 Y windows (registers 2-65); returns the number of windows used */
+int metadata_get_windows(uint16_t registers[128], int ystart[32], int ysize[32]);
+
+/* register 68; subsampling also returns Sub_offset and Sub_step (registers 66, 67) */
+int metadata_get_subsampling(uint16_t registers[128], int * offset, int * step);
+int metadata_get_binning(uint16_t registers[128]);
+
 #endif
@@ -0,0 +1,50 @@
+#ifndef _parallel_h_
+#define _parallel_h_
+
+/**
+ * Parallel loops for per-pixel processing (OpenMP)
+ *
+ * Reproducibility: all loops using these helpers either write disjoint
+ * pixels (one row belongs to exactly one thread), or reduce integer
+ * values (order-independent). Floating-point accumulations must be done
+ * in integers, or per row and combined in a fixed order.
+ * That way, the output does not depend on the number of threads.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+#include "omp.h"
+
+#define _PARALLEL_PRAGMA(x) _Pragma(#x)
+
+/* split a loop (usually over image rows) into equal chunks, one per thread */
+#define PARALLEL_FOR \
+    _PARALLEL_PRAGMA(omp parallel for schedule(static))
+
+/* same, with an integer sum reduction on the listed variables */
+#define PARALLEL_FOR_SUM(...) \
+    _PARALLEL_PRAGMA(omp parallel for schedule(static) reduction(+:__VA_ARGS__))
+
+/* 0 = use all available cores */
+static inline void parallel_set_threads(int num_threads)
+{
+    if (num_threads > 0)
+    {
+        omp_set_num_threads(num_threads);
+    }
+}
+
+#endif
@@ -45,6 +45,7 @@ static int g_debug_flags;
 /* out = a - b */
 static void subtract(int16_t * a, int16_t * b, int16_t * out, int w, int h)
 {
+    #pragma omp parallel for
     for (int i = 0; i < w*h; i++)
     {
         out[i] = a[i] - b[i];
@@ -54,6 +55,7 @@ static void subtract(int16_t * a, int16_t * b, int16_t * out, int w, int h)
 /* out = (a + b) / 2 */
 static void average(int16_t * a, int16_t * b, int16_t * out, int w, int h)
 {
+    #pragma omp parallel for
     for (int i = 0; i < w*h; i++)
     {
         out[i] = ((int)a[i] + (int)b[i]) / 2;
@@ -73,26 +75,12 @@ static void transpose(int16_t * in, int16_t * out, int w, int h)
     }
 }
 
-static void horizontal_gradient(int16_t * in, int16_t * out, int w, int h)
-{
-    for (int i = 2; i < w*h-2; i++)
-    {
-        out[i] = in[i-2] - in[i+2];
-    }
-
-    out[0] = out[1] = out[w*h-1] = out[w*h-2] = 0;
-}
-
 static void horizontal_edge_aware_blur_rggb(
     int16_t * in_r,  int16_t * in_g1,  int16_t * in_g2,  int16_t * in_b,
     int16_t * out_r, int16_t * out_g1, int16_t * out_g2, int16_t * out_b,
     int w, int h, int edge_thr, int strength_lo, int strength_hi, int strength_thr)
 {
     const int NMAX = 256;
-    int g1[NMAX];
-    int g2[NMAX];
-    int rg[NMAX];
-    int bg[NMAX];
     if (MAX(strength_lo, strength_hi) > NMAX)
     {
         printf("FIXME: blur too strong\n");
@@ -107,8 +95,15 @@ static void horizontal_edge_aware_blur_rggb(
     subtract(in_r, avg_g, dif_rg, w, h);
     subtract(in_b, avg_g, dif_bg, w, h);
 
+    /* rows are independent, so each thread takes a band of rows */
+    #pragma omp parallel for schedule(dynamic, 16)
     for (int y = 0; y < h; y++)
     {
+        int g1[NMAX];
+        int g2[NMAX];
+        int rg[NMAX];
+        int bg[NMAX];
+
         for (int x = 0; x < w; x++)
         {
             int p0 = avg_g[x + y*w];
@@ -165,112 +160,214 @@ static void horizontal_edge_aware_blur_rggb(
     free(dif_bg);
 }
 
-/* Find and apply a scalar offset to each column, to reduce pattern noise */
-/* original: input and output */
-/* denoised: input only */
-static void fix_column_noise(int16_t * original, int16_t * denoised, int w, int h, int clip_thr, int nonlinear_highlights)
+/* column noise histograms: noise values (raw16 units) from -COLNOISE_RANGE to COLNOISE_RANGE-1 */
+/* values outside this range are clamped, so the median is exact as long as it's within +/- 32 DN */
+#define COLNOISE_RANGE 256
+#define COLNOISE_BINS  (2 * COLNOISE_RANGE)
+
+/* is this pixel usable for estimating column noise? if yes, return its noise value in *out_noise */
+/* certain areas will give false readings, mask them out */
+static inline int colnoise_sample(int16_t * original, int16_t * denoised, int i, int n, int clip_thr, int nonlinear_highlights, int * out_noise)
 {
     /* let's say the difference between original and denoised is mostly noise */
-    int16_t * noise = malloc(w * h * sizeof(noise[0]));
-    subtract(original, denoised, noise, w, h);
+    int16_t noise_val = original[i] - denoised[i];
 
-    /* from this noise, keep the FPN part (constant offset for each line/column) */
-    int col_offsets_size = w * sizeof(int);
-    int* col_offsets = malloc(col_offsets_size);
-    int* noise_row = malloc(MAX(w,h) * sizeof(noise_row[0]));
-    int  noise_row_num = 0;
+    /* horizontal gradient, computed on the flattened buffer */
+    int16_t hgradient = (i >= 2 && i < n-2) ? original[i-2] - original[i+2] : 0;
 
-    /* certain areas will give false readings, mask them out */
-    int16_t * mask  = malloc(w * h * sizeof(mask[0]));
-    int16_t * hgrad = malloc(w * h * sizeof(mask[0]));
+    int pixel = original[i];
 
-    horizontal_gradient(original, hgrad, w, h);
+    *out_noise = noise_val;
 
-    for (int y = 0; y < h; y++)
+    int masked =
+        (noise_val == 0)  ||        /* hack: figure out why does this appear to give much better results, and whether there are side effects */
+        (abs(hgradient) > 500) ||   /* mask out pixels on a strong edge, that is clearly not pattern noise */
+        (nonlinear_highlights ?     /* row noise is very different in nonlinear (nearly clipped) highlights, compared to the rest of the image */
+               pixel <= clip_thr :  /* NL highlights: mask out normally-exposed areas */
+               pixel > clip_thr );  /* regular image: mask out nearly-overexposed pixels */
+
+    return !masked;
+}
+
+/* k-th smallest value from a histogram with COLNOISE_BINS bins (same k as median_int_wirth) */
+static int colnoise_hist_median(uint16_t * hist, int num)
+{
+    int k = (num & 1) ? num/2 : num/2 - 1;
+    int acc = 0;
+    for (int b = 0; b < COLNOISE_BINS; b++)
     {
-        for (int x = 0; x < w; x++)
+        acc += hist[b];
+        if (acc > k)
         {
-            int pixel = original[x + y*w];
-            int hgradient = abs(hgrad[x + y*w]);
-            int noise_val = noise[x + y*w];
-
-            mask[x + y*w] =
-                (noise_val == 0)  ||    /* hack: figure out why does this appear to give much better results, and whether there are side effects */
-                (hgradient > 500) ||    /* mask out pixels on a strong edge, that is clearly not pattern noise */
-                (nonlinear_highlights ? /* row noise is very different in nonlinear (nearly clipped) highlights, compared to the rest of the image */
-                       pixel <= clip_thr : /* NL highlights: mask out normally-exposed areas */
-                       pixel > clip_thr ); /* regular image: mask out nearly-overexposed pixels */
+            return b - COLNOISE_RANGE;
         }
     }
+    return 0;
+}
 
-    if (g_debug_flags & FIXPN_DBG_DENOISED)
+/* debug: replace the image with denoised image, noise image or mask */
+static void fix_column_noise_debug(int16_t * original, int16_t * denoised, int w, int h, int clip_thr, int nonlinear_highlights)
+{
+    /* the mask needs the unmodified neighbours, so we work on a copy (debug only) */
+    int16_t * orig = malloc(w * h * sizeof(orig[0]));
+    memcpy(orig, original, w * h * sizeof(orig[0]));
+
+    for (int i = 0; i < w*h; i++)
     {
-        /* debug: show denoised image */
-        for (int i = 0; i < w*h; i++)
+        int noise_val;
+        int valid = colnoise_sample(orig, denoised, i, w*h, clip_thr, nonlinear_highlights, &noise_val);
+
+        if (g_debug_flags & FIXPN_DBG_DENOISED)
+        {
+            /* debug: show denoised image */
             original[i] = MAX(denoised[i], 0);
-        goto end;
+        }
+        else if (g_debug_flags & FIXPN_DBG_NOISE)
+        {
+            /* debug: show the noise image */
+            original[i] = valid ? (int16_t)(noise_val + 1500) : 0;
+        }
+        else if (g_debug_flags & FIXPN_DBG_MASK)
+        {
+            /* debug: show the mask */
+            original[i] = valid ? 0 : 1000;
+        }
     }
-    else if (g_debug_flags & FIXPN_DBG_NOISE)
+
+    free(orig);
+}
+
+/* columns are processed in blocks of this size, each block by a single thread */
+/* (one block of histograms is 64 KiB, small enough to stay in cache) */
+#define COLNOISE_BLOCK 64
+
+/* column offsets are the negated medians, from -COLNOISE_RANGE+1 to COLNOISE_RANGE */
+#define COLNOISE_OFFSET_BINS (COLNOISE_BINS + 1)
+
+/* estimate column offsets for columns x0...x1-1 of one channel */
+/* also build a histogram of these offsets, for the color cast fix */
+static void fix_column_noise_block(int16_t * original, int16_t * denoised, int w, int h, int x0, int x1,
+                                   int clip_thr, int nonlinear_highlights, int * col_offsets, int * offset_hist)
+{
+    /* from the noise image, keep the FPN part (constant offset for each line/column) */
+    /* one histogram for each column, filled in a single row-major pass */
+    int bw = x1 - x0;
+    int col_num[COLNOISE_BLOCK] = {0};
+    uint16_t * hist = calloc(bw * COLNOISE_BINS, sizeof(hist[0]));
+
+    for (int y = 0; y < h; y++)
     {
-        /* debug: show the noise image */
-        for (int i = 0; i < w*h; i++)
+        for (int x = x0; x < x1; x++)
         {
-            if (mask[i]) noise[i] = -1500;
-            original[i] = noise[i] + 1500;
+            int noise_val;
+            if (colnoise_sample(original, denoised, x + y*w, w*h, clip_thr, nonlinear_highlights, &noise_val))
+            {
+                int bin = COERCE(noise_val + COLNOISE_RANGE, 0, COLNOISE_BINS - 1);
+                hist[(x - x0) * COLNOISE_BINS + bin]++;
+                col_num[x - x0]++;
+            }
         }
-        goto end;
     }
-    else if (g_debug_flags & FIXPN_DBG_MASK)
+
+    /* take the median value for each column, in the noise image */
+    for (int x = x0; x < x1; x++)
     {
-        /* debug: show the mask */
-        for (int i = 0; i < w*h; i++)
-            original[i] = mask[i] * 1000;
-        goto end;
+        int offset = (col_num[x - x0] < 10) ? 0 : -colnoise_hist_median(hist + (x - x0) * COLNOISE_BINS, col_num[x - x0]);
+        col_offsets[x] = offset;
+        offset_hist[offset + COLNOISE_RANGE]++;
     }
 
-    /* take the median value for each column, in the noise image */
-    for (int x = 0; x < w; x++)
+    free(hist);
+}
+
+/* median of the column offsets, from the per-block histograms (same k as median_int_wirth) */
+static int fix_column_noise_reduce(int * offset_hists, int num_blocks, int w)
+{
+    /* reduction: add all partial histograms into the first one */
+    int * total = offset_hists;
+    for (int b = 1; b < num_blocks; b++)
     {
-        noise_row_num = 0;
-        for (int y = 0; y < h; y++)
+        int * partial = offset_hists + b * COLNOISE_OFFSET_BINS;
+        for (int i = 0; i < COLNOISE_OFFSET_BINS; i++)
         {
-            if (mask[x + y*w] == 0)
-            {
-                noise_row[noise_row_num++] = noise[x + y*w];
-            }
+            total[i] += partial[i];
         }
+    }
 
-        int offset = (noise_row_num < 10) ? 0 : -median_int_wirth(noise_row, noise_row_num);
+    int k = (w & 1) ? w/2 : w/2 - 1;
+    int acc = 0;
+    for (int i = 0; i < COLNOISE_OFFSET_BINS; i++)
+    {
+        acc += total[i];
+        if (acc > k)
+        {
+            return i - COLNOISE_RANGE;
+        }
+    }
+    return 0;
+}
 
-        col_offsets[x] = offset;
+/* Find and apply a scalar offset to each column, to reduce pattern noise */
+/* original: input and output (4 color channels) */
+/* denoised: input only (4 color channels) */
+/* work is split by channel and by blocks of columns (estimation) or rows (correction) */
+static void fix_column_noise(int16_t * original[4], int16_t * denoised[4], int w, int h, int clip_thr, int nonlinear_highlights)
+{
+    if (g_debug_flags & (FIXPN_DBG_DENOISED | FIXPN_DBG_NOISE | FIXPN_DBG_MASK))
+    {
+        # pragma omp parallel for
+        for (int k = 0; k < 4; k++)
+        {
+            fix_column_noise_debug(original[k], denoised[k], w, h, clip_thr, nonlinear_highlights);
+        }
+        return;
+    }
+
+    int num_blocks = (w + COLNOISE_BLOCK - 1) / COLNOISE_BLOCK;
+    int* col_offsets = malloc(4 * w * sizeof(col_offsets[0]));
+    int* offset_hists = calloc(4 * num_blocks * COLNOISE_OFFSET_BINS, sizeof(offset_hists[0]));
+    int mc[4];
+
+    # pragma omp parallel for collapse(2) schedule(dynamic)
+    for (int k = 0; k < 4; k++)
+    {
+        for (int b = 0; b < num_blocks; b++)
+        {
+            fix_column_noise_block(original[k], denoised[k], w, h,
+                b * COLNOISE_BLOCK, MIN((b + 1) * COLNOISE_BLOCK, w),
+                clip_thr, nonlinear_highlights, col_offsets + k * w,
+                offset_hists + (k * num_blocks + b) * COLNOISE_OFFSET_BINS
+            );
+        }
     }
 
     /* remove median from offsets, to prevent color cast */
-    /* note: median modifies the array, so we allocate a copy */
-    int* col_offsets_copy = malloc(col_offsets_size);
-    memcpy(col_offsets_copy, col_offsets, col_offsets_size);
-    int mc = median_int_wirth(col_offsets_copy, w);
-    free(col_offsets_copy);
+    for (int k = 0; k < 4; k++)
+    {
+        mc[k] = fix_column_noise_reduce(offset_hists + k * num_blocks * COLNOISE_OFFSET_BINS, num_blocks, w);
+    }
 
     /* almost done, now apply the offsets */
-    for (int y = 0; y < h; y++)
+    # pragma omp parallel for collapse(2)
+    for (int k = 0; k < 4; k++)
     {
-        for (int x = 0; x < w; x++)
+        for (int y = 0; y < h; y++)
         {
-            int pixel = original[x + y*w];
-            if (nonlinear_highlights ? pixel > clip_thr : pixel <= clip_thr)
+            int16_t * row = original[k] + y*w;
+            int * offsets = col_offsets + k * w;
+            for (int x = 0; x < w; x++)
             {
-                original[x + y*w] = COERCE((int)original[x + y*w] + col_offsets[x] - mc, -32767, 32760);
+                int pixel = row[x];
+                if (nonlinear_highlights ? pixel > clip_thr : pixel <= clip_thr)
+                {
+                    row[x] = COERCE(pixel + offsets[x] - mc[k], -32767, 32760);
+                }
             }
         }
     }
 
-end:
-    free(noise);
     free(col_offsets);
-    free(noise_row);
-    free(mask);
-    free(hgrad);
+    free(offset_hists);
 }
 
 /* extract a color channel from a Bayer image */
@@ -278,6 +375,7 @@ end:
 /* dx and dy can be 0 or 1 */
 static void extract_channel(int16_t * in, int16_t * out, int w, int h, int dx, int dy)
 {
+    #pragma omp parallel for
     for (int y = dy; y < h; y += 2)
     {
         for (int x = dx; x < w; x += 2)
@@ -292,6 +390,7 @@ static void extract_channel(int16_t * in, int16_t * out, int w, int h, int dx, i
 /* dx and dy can be 0 or 1 */
 static void set_channel(int16_t * out, int16_t * in, int w, int h, int dx, int dy)
 {
+    #pragma omp parallel for
     for (int y = dy; y < h; y += 2)
     {
         for (int x = dx; x < w; x += 2)
@@ -320,7 +419,6 @@ static void fix_column_noise_rggb(int16_t * raw, int16_t * denoised, int w, int
     double t0,t1,t2,t3,t4;
     t0 = omp_get_wtime();
     /* extract half-res color channels from Bayer data */
-    # pragma omp parallel for
     for (int k = 0; k < 4; k++)
     {
         extract_channel(raw, bayer0[k],  w, h, (k/2)%2, (k+1)%2);
@@ -333,7 +431,6 @@ static void fix_column_noise_rggb(int16_t * raw, int16_t * denoised, int w, int
 
     if (denoised)
     {
-        # pragma omp parallel for
         for (int k = 0; k < 4; k++)
         {
             extract_channel(denoised, bayers[k],  w, h, (k/2)%2, (k+1)%2);
@@ -357,17 +454,12 @@ static void fix_column_noise_rggb(int16_t * raw, int16_t * denoised, int w, int
     int hl_en = !g_debug_flags;
     for (int hl = 0; hl <= hl_en; hl++)
     {
-        # pragma omp parallel for
-        for (int k = 0; k < 4; k++)
-        {
-            fix_column_noise(bayer0[k],  bayers[k],  w/2, h/2, clip_thr, hl);
-        }
+        fix_column_noise(bayer0, bayers, w/2, h/2, clip_thr, hl);
     }
 
     t3 = omp_get_wtime();
 
     /* commit changes */
-    # pragma omp parallel for
     for (int k = 0; k < 4; k++)
     {
         set_channel(raw, bayer0[k], w, h, (k/2)%2, (k+1)%2);
@@ -83,6 +83,19 @@ struct raw12_twopix
     unsigned b_lo: 8;
 } __attribute__((packed));
 
+/* four pixels packed as 10-bit (same bit order as raw12: MSB first) */
+struct raw10_fourpix
+{
+    unsigned a_hi: 8;
+    unsigned b_hi: 6;
+    unsigned a_lo: 2;
+    unsigned c_hi: 4;
+    unsigned b_lo: 4;
+    unsigned d_hi: 2;
+    unsigned c_lo: 6;
+    unsigned d_lo: 8;
+} __attribute__((packed));
+
 
 /* call this before performing any raw image analysis */
 /* returns 1=success, 0=failed */
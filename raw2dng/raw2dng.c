@@ -23,17 +23,22 @@
 #include "stdint.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "stddef.h"
 #include "string.h"
 #include "ctype.h"
 #include "unistd.h"
 #include "sys/stat.h"
+#include "sys/mman.h"
+#include "fcntl.h"
 #include "math.h"
 #include "raw.h"
 #include "chdk-dng.h"
 #include "cmdoptions.h"
 #include "patternnoise.h"
 #include "metadata.h"
+#include "badpixels.h"
 #include "wirth.h"
+#include "parallel.h"
 #include "assert.h"
 
 static int16_t Lut_R[4096*8];
@@ -41,6 +46,31 @@ static int16_t Lut_G1[4096*8];
 static int16_t Lut_G2[4096*8];
 static int16_t Lut_B[4096*8];
 
+#define LUT_SIZE (4096*8)
+#define LUT_MAGIC "R2DLUT1"
+
+/**
+ * Compiled LUT, cached next to the .spi1d file (lut-xN.spi1d.bin),
+ * in native byte order, so it can be mapped directly into memory.
+ * The tables are indexed by row parity (so each row uses only two tables,
+ * without any per-pixel branching), then by column parity.
+ */
+struct compiled_lut
+{
+    char magic[8];
+    uint32_t gain;
+    uint32_t size;              /* LUT_SIZE */
+    uint64_t hash;              /* FNV-1a hash of the .spi1d file */
+    uint32_t components;        /* from the .spi1d file */
+    uint32_t length;
+
+    /* Bayer pattern: [G2 B; R G1] */
+    int16_t lut[2][2][LUT_SIZE];
+};
+
+static struct compiled_lut * compiled_lut = 0;
+static int compiled_lut_mapped = 0;     /* 1 = LUT cache file, 2 = calibration store */
+
 /* matched colorchecker_gainx2_15ms_01.raw12 (linearized and pattern noise corrected)
  * with ColorcheckerPassport NIKON.NEF (Nikon D800E) */
 #define CAM_COLORMATRIX1                          \
@@ -49,7 +79,7 @@ static int16_t Lut_B[4096*8];
    -1283, 10000,     3550, 10000,    5967, 10000
 
 #define DARKFRAME_OFFSET 1024
-#define GAINFRAME_SCALING 16384
+#define GAINFRAME_SCALING 16384     /* must be 1 << 14 (see apply_gain_pixel) */
 #define DCNUFRAME_OFFSET 8192
 #define DCNUFRAME_SCALING 8192
 
@@ -63,12 +93,17 @@ int black_level = 0;
 int white_level = 4095;
 int image_width = 0;
 int image_height = 0;
+int image_xstart = 0;
+int input_bits = 0;
 int bayer_order = 0;
 int gain = 0;
 int swap_lines = 0;
 int hdmi_ramdump = 0;
 int pgm_input = 0;
 int use_lut = 0;
+int no_plr = 0;
+int no_dual_expo = 0;
+int output_16bit = 0;
 int fixpn = 0;
 int fixpn_flags1 = 0;
 int fixpn_flags2 = 0;
@@ -83,13 +118,23 @@ int no_blackcol_ff = 0;
 int rownoise_filter = 0;
 int rownoise_export_octave = 0;
 int dc_hot_pixels = 0;
+int fix_bad_pixels = 0;
+int dng_gainmap = 0;
 int no_processing = 0;
+int window_output = 0;
+int num_threads = 0;
 int pixel_extract_xy[2] = {-1,-1};
 
 int calc_darkframe = 0;
 int calc_clipframe = 0;
 int calc_gainframe = 0;
 int calc_dcnuframe = 0;
+int calc_darkall = 0;
+int robust_stack = 0;
+int stack_memory = 256;
+int calib_checkpoint = 0;
+int calib_pack = 0;
+int calib_export = 0;
 
 int check_darkframe = 0;
 
@@ -105,6 +150,11 @@ struct cmd_group options[] = {
             { &image_height,   1, "--height=%d",   "Set image height\n"
                              "                      - default: autodetect from file size\n"
                              "                      - if input is stdin, default is 3072" },
+            { &image_xstart,   1, "--xstart=%d",   "Horizontal offset of a cropped image in the calibration frames (default: 0)\n"
+                             "                      - vertical offset, subsampling and binning are read from metadata" },
+            { &input_bits,     1, "--bits=%d",     "Bit depth of the raw data: 12, 10 or 8 (default: autodetect)\n"
+                             "                      - from metadata (Bit_mode) and file size; the DNG uses the same bit depth (unless --16bit)\n"
+                             "                      - black and white levels are always given as 12-bit values" },
             { &bayer_order,  1, "--bayer-order=%d", "Set bayer order (1 = RGGB, 2 = GBRG, 3 = GRBG, 4 = BGGR (default: 2 = GBRG)" },
             { &gain,         1, "--gain=%d", "Set analog gain matching image sensor settings if no metadata is provided)" },
             { &swap_lines,     1,  "--swap-lines", "Swap lines in the raw data\n"
@@ -113,8 +163,24 @@ struct cmd_group options[] = {
                              "                      used for HDMI recording experiments" },
             { &pgm_input,      1,  "--pgm",        "Expect 16-bit PGM input from stdin\n" },
             { &use_lut,        1,  "--lut",        "Use a 1D LUT (lut-xN.spi1d, N=gain, OCIO-like)\n" },
+            { &use_lut,        2,  "--dng-lut",    "Store the 1D LUT in the DNG (LinearizationTable), don't apply it\n"
+                             "                      - only for 1-component LUTs (otherwise, same as --lut)" },
+            { &no_plr,         1,  "--no-plr",     "Do not linearize multi-slope (PLR) exposures\n"
+                             "                      - by default, a LUT is built from the PLR registers and used instead of lut-xN.spi1d\n"
+                             "                        (applied to the pixels, or stored in the DNG with --dng-lut)" },
+            { &no_dual_expo,   1,  "--no-dual-expo", "Do not merge interleaved dual exposures (Exp_dual)\n"
+                             "                      - by default, the two exposures are merged into a 16-bit DNG" },
+            { &output_16bit,   1,  "--16bit",      "Save the processed data as 16-bit DNG, without packing\n"
+                             "                      - no rounding or dithering; larger files, faster to write and decode\n"
+                             "                      - values are 12-bit x 8 (black and white levels are scaled to match)" },
             { &no_processing,  1, "--totally-raw", "Copy the raw data without any manipulation\n"
                              "                      - metadata and pixel reordering are allowed." },
+            { &window_output,  1, "--split-windows", "Multi-window readout (Y_start/Y_size): one DNG per window\n"
+                             "                      (name-w1.DNG, name-w2.DNG ...; default: windows stacked in readout order)" },
+            { &window_output,  2, "--stitch-windows","Multi-window readout: place each window at its position on the sensor\n"
+                             "                      (gaps between windows are filled with black)" },
+            { &num_threads,    1, "--threads=%d",  "Number of processing threads (default: all cores)\n"
+                             "                      - output is identical for any number of threads" },
             OPTION_EOL,
         },
     },
@@ -137,6 +203,12 @@ struct cmd_group options[] = {
     {
         "Flat field correction", (struct cmd_option[]) {
             { &dc_hot_pixels,  1, "--dchp",        "Measure hot pixels to scale dark current frame" },
+            { &fix_bad_pixels, 1, "--fix-badpix",  "Interpolate bad pixels from badpixels-xN.txt\n"
+                             "                      (created by --calc-darkframe and --calc-gainframe)" },
+            { &fix_bad_pixels, 2, "--dng-badpix",  "List bad pixels in the DNG (FixBadPixelsList opcode)\n"
+                             "                      and let the raw processor interpolate them" },
+            { &dng_gainmap,    1, "--dng-gainmap", "Store the gain frame in the DNG (GainMap opcodes), don't apply it\n"
+                             "                      - also works without a dark frame (no processing needed)" },
             { &no_darkframe,   1,"--no-darkframe", "Disable dark frame (if darkframe-xN.pgm is present)" },
             { &no_dcnuframe,   1,"--no-dcnuframe", "Disable dark current frame (if dcnuframe-xN.pgm is present)" },
             { &no_gainframe,   1,"--no-gainframe", "Disable gain frame (if gainframe-xN.pgm is present)" },
@@ -148,9 +220,28 @@ struct cmd_group options[] = {
             { &calc_dcnuframe,1,"--calc-dcnuframe","Fit a dark frame (constant offset) and a dark current frame\n"
                              "                      (exposure-dependent offset) from files with different exposures\n"
                              "                      (starting point: 256 frames with exposures from 1 to 50 ms)" },
+            { &calc_darkall,  1,"--calc-darkall",  "Combined --calc-dcnuframe, --calc-darkframe and --check-darkframe\n"
+                             "                      in a single pass over the input files; outputs:\n"
+                             "                      - darkframe-xN.pgm and dcnuframe-xN.pgm (linear fit)\n"
+                             "                      - darkavg-xN.pgm (average) and badpixels-xN.txt\n"
+                             "                      - darkcheck-xN.json (quality report)\n"
+                             "                      - the quality indicators are measured before dark frame correction\n"
+                             "                        (raw FPN; for the residuals, run --check-darkframe afterwards)" },
             { &calc_gainframe,1,"--calc-gainframe","Average a gain frame (aka flat field frame)" },
             { &calc_clipframe,1,"--calc-clipframe","Average a clip (overexposed) frame" },
+            { &robust_stack,  1,"--median-stack",  "With --calc-darkframe: per-pixel median of all frames\n"
+                             "                      (default: average without min/max values)" },
+            { &robust_stack,  2,"--sigma-stack",   "With --calc-darkframe: per-pixel kappa-sigma clipped average (3 sigma)" },
+            { &stack_memory,  1,"--stack-mem=%d",  "Memory budget for --median-stack and --sigma-stack, in MB (default: 256)\n"
+                             "                      - input files are read again, one band of rows at a time" },
+            { &calib_checkpoint,1,"--checkpoint",  "Save the calibration state (e.g. darkframe-xN.ckpt) and resume from it\n"
+                             "                      - input files already included are skipped\n"
+                             "                      - new frames are added without reprocessing the old ones" },
             { &check_darkframe,1,"--check-darkframe","Check image quality indicators on a dark frame" },
+            { &calib_pack,    1,"--calib-pack",    "Pack all reference files for each gain into calib-xN.bin (no input files)\n"
+                             "                      - memory-mapped when loading, used instead of the individual files\n"
+                             "                      - ignored if any of the packed files was changed afterwards" },
+            { &calib_export,  1,"--calib-export",  "Verify calib-xN.bin and export its frames to PGM (existing files are kept)" },
 
             OPTION_EOL,
         },
@@ -190,6 +281,8 @@ struct raw_info raw_info;
    ({ __typeof__ (a) _a = (a); \
      _a > 0 ? _a : -_a; })
 
+#define COERCE(x,lo,hi) MAX(MIN((x),(hi)),(lo))
+
 #define COUNT(x)        ((int)(sizeof(x)/sizeof((x)[0])))
 
 void raw_set_geometry(int width, int height, int skip_left, int skip_right, int skip_top, int skip_bottom)
@@ -224,30 +317,30 @@ struct raw_info raw_info = {
     .color_matrix1 = {CAM_COLORMATRIX1},// camera-specific, from dcraw.c
 };
 
-/* apply a constant offset to each raw12 pixel */
-static void raw12_data_offset(void* buf, int frame_size, int offset)
-{
-    struct raw12_twopix * buf2 = (struct raw12_twopix *) buf;
-    for (int i = 0; i < frame_size / sizeof(struct raw12_twopix); i ++)
-    {
-        unsigned a = (buf2[i].a_hi << 4) | buf2[i].a_lo;
-        unsigned b = (buf2[i].b_hi << 8) | buf2[i].b_lo;
-
-        a = MIN(a + offset, 4095);
-        b = MIN(b + offset, 4095);
+/**
+ * Black reference columns: 8 at each side of the sensor, at full resolution.
+ * With horizontal crop, subsampling or binning, fewer of them are read out
+ * (see black_columns_update); in the image, they are the first "left"
+ * and the last "right" columns.
+ */
+#define BLACK_COLUMNS 8
 
-        buf2[i].a_lo = a; buf2[i].a_hi = a >> 4;
-        buf2[i].b_lo = b; buf2[i].b_hi = b >> 8;
-    }
-}
+static struct
+{
+    int left;
+    int right;
+} black_cols = { BLACK_COLUMNS, BLACK_COLUMNS };
 
 /* compute offset for odd/even rows, at left and right of the frame, and average offset */
+/* if black columns are only present at one side, both sides get the same offsets */
 static void calc_black_columns_offset(struct raw_info * raw_info, int16_t * raw16, int offsets[4], int* avg_offset)
 {
     int w = raw_info->width;
     int h = raw_info->height;
+    int left = black_cols.left;
+    int right = black_cols.right;
 
-    int max_samples = h / 2;
+    int max_samples = (h + 1) / 2;
     int* samples[4];
     for (int i = 0; i < 4; i++)
     {
@@ -261,23 +354,35 @@ static void calc_black_columns_offset(struct raw_info * raw_info, int16_t * raw1
          * if we compute median horizontally on every 8 columns,
          * then median on odd/even rows from the resulting medians.
          */
-        int row[8];
-        for (int x = 0; x < 8; x++)
+        int row[BLACK_COLUMNS];
+        if (left)
         {
-            row[x] = raw16[x + y*w];
+            for (int x = 0; x < left; x++)
+            {
+                row[x] = raw16[x + y*w];
+            }
+            samples[y%2][num_samples[y%2]++] = median_int_wirth2(row, left);
         }
-        samples[y%2][num_samples[y%2]++] = median_int_wirth2(row, 8);
 
-        for (int x = w-8; x < w; x++)
+        if (right)
         {
-            row[x-w+8] = raw16[x + y*w];
+            for (int x = w-right; x < w; x++)
+            {
+                row[x-w+right] = raw16[x + y*w];
+            }
+            samples[2+y%2][num_samples[2+y%2]++] = median_int_wirth2(row, right);
         }
-        samples[2+y%2][num_samples[2+y%2]++] = median_int_wirth2(row, 8);
     }
 
     for (int i = 0; i < 4; i++)
     {
-        offsets[i] = median_int_wirth2(samples[i], num_samples[i]);
+        offsets[i] = num_samples[i] ? median_int_wirth2(samples[i], num_samples[i]) : 0;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        if (!left)  offsets[i] = offsets[2+i];
+        if (!right) offsets[2+i] = offsets[i];
     }
 
     for (int i = 0; i < 4; i++)
@@ -357,6 +462,8 @@ static void remove_fixed_frequencies(int* row_noise, int n)
 {
     double mag = 0;
     double thr = 0.5;
+    double last_f = 0;
+    double last_mag = 0;
     do
     {
         double f = scan_fixed_freq(row_noise, n, 1/250.0, 1/2.0, &mag);
@@ -364,6 +471,14 @@ static void remove_fixed_frequencies(int* row_noise, int n)
         /* scale "mag" to 12-bit DN units */
         mag = mag/16/8;
 
+        if (f == last_f && mag >= last_mag)
+        {
+            /* not converging (near 1/2, fix_fixed_freq overshoots); give up */
+            break;
+        }
+        last_f = f;
+        last_mag = mag;
+
         if (mag > thr)
         {
             printf("Fixed freq  : 1/%.4g (mag=%.3g)\n", 1/f, mag);
@@ -373,7 +488,9 @@ static void remove_fixed_frequencies(int* row_noise, int n)
     while (mag > thr);
 }
 
-static void subtract_black_columns(struct raw_info * raw_info, int16_t * raw16)
+/* row_offsets: if not null, receives the offsets subtracted from each row (2*h values):
+ * off(x,y) = row_offsets[2*y] + row_offsets[2*y+1] * x / w */
+static void subtract_black_columns(struct raw_info * raw_info, int16_t * raw16, int * row_offsets)
 {
     int w = raw_info->width;
     int h = raw_info->height;
@@ -387,6 +504,7 @@ static void subtract_black_columns(struct raw_info * raw_info, int16_t * raw16)
     printf("Even rows   : %d...%d\n", offsets[0]/8, offsets[2]/8);
     printf("Odd rows    : %d...%d\n", offsets[1]/8, offsets[3]/8);
 
+    PARALLEL_FOR
     for (int y = 0; y < h; y++)
     {
         for (int x = 0; x < w; x++)
@@ -396,6 +514,12 @@ static void subtract_black_columns(struct raw_info * raw_info, int16_t * raw16)
             int off = off_l + (off_r - off_l) * x / w - target_black_level;
             raw16[x + y*w] -= off;
         }
+
+        if (row_offsets)
+        {
+            row_offsets[2*y]   = offsets[y%2] - target_black_level;
+            row_offsets[2*y+1] = offsets[2 + y%2] - offsets[y%2];
+        }
     }
 
     if (no_blackcol_rn)
@@ -422,20 +546,24 @@ static void subtract_black_columns(struct raw_info * raw_info, int16_t * raw16)
 
     /* black column row averages x16 */
     int* black_col = malloc(h * sizeof(black_col[0]));
+    int left = black_cols.left;
+    int right = black_cols.right;
 
+    PARALLEL_FOR
     for (int y = 0; y < h; y++)
     {
         int acc = 0;
         for (int x = 0; x < w; x++)
         {
-            if (x == 8)
+            if (x == left)
             {
                 /* fast forward to the right side */
-                x = w - 8;
+                x = w - right;
+                if (x == w) break;
             }
             acc += raw16[x + y*w] - target_black_level;
         }
-        black_col[y] = acc;
+        black_col[y] = acc * 16 / (left + right);
     }
 
     if (!no_blackcol_ff)
@@ -481,20 +609,23 @@ static void subtract_black_columns(struct raw_info * raw_info, int16_t * raw16)
     int lags[4] = {-2, -1 , 1, 2};
     int* samples = malloc(w/2 * sizeof(samples[0]));
 
+    /* green pixels are at (x + y) % 2 == green_phase (0 for GBRG and GRBG) */
+    int green_phase = (raw_info->cfa_pattern & 0xFF) == 1 ? 0 : 1;
+
     for (int k = 0; k < 4; k++)
     {
         green_delta[k] = malloc(h * sizeof(green_delta[0][0]));
 
         for (int y = 2; y < h-2; y++)
         {
-            for (int x = 8 + y%2; x < w-8; x += 2)
+            int n = 0;
+            for (int x = left + (left + y + green_phase) % 2; x < w-right; x += 2)
             {
-                /* when x and y have the same parity, we are on a green channel (GBRG) */
                 int lag = lags[k];
-                samples[x/2-4] = raw16[x + y*w] - raw16[x - lag%2 + (y+lag) * w];
+                samples[n++] = raw16[x + y*w] - raw16[x - lag%2 + (y+lag) * w];
             }
             /* green_delta is also multiplied by 16, like black_col */
-            green_delta[k][y] = median_int_wirth(samples, (w-16) / 2) * 16;
+            green_delta[k][y] = median_int_wirth(samples, n) * 16;
         }
     }
 
@@ -536,6 +667,7 @@ static void subtract_black_columns(struct raw_info * raw_info, int16_t * raw16)
         fclose(f);
     }
 
+    PARALLEL_FOR
     for (int y = 2; y < h-2; y++)
     {
         int offset = (
@@ -584,6 +716,11 @@ static void subtract_black_columns(struct raw_info * raw_info, int16_t * raw16)
         {
             raw16[x + y*w] -= offset;
         }
+
+        if (row_offsets)
+        {
+            row_offsets[2*y] += offset;
+        }
     }
 
     free(samples);
@@ -613,15 +750,8 @@ static int file_exists(char * filename)
     return (stat (filename, &buffer) == 0);
 }
 
-static int file_exists_warn(char * filename)
-{
-    int ans = file_exists(filename);
-    if (!ans) printf("Not found   : %s\n", filename);
-    return ans;
-}
-
-/* for dark frames, clip frames, gray frames, stuff like that */
-static void read_reference_frame(char* filename, int16_t * buf, struct raw_info * raw_info, int meta_ystart, int meta_ysize)
+/* open a 16-bit PGM file and parse its header; the file pointer is left at the pixel data */
+static FILE* open_pgm(char* filename, int* out_width, int* out_height)
 {
     FILE* fp = fopen(filename, "rb");
     CHECK(fp, "could not open %s", filename);
@@ -645,333 +775,1693 @@ static void read_reference_frame(char* filename, int16_t * buf, struct raw_info
 
     CHECK(!(error || nd < 3), "not a valid PGM file\n");
 
-    int width = dim[0];
-    int height = dim[1];
-
+    *out_width = dim[0];
+    *out_height = dim[1];
+    return fp;
+}
 
-    if (meta_ystart)
-    {
-        /* if our frame is cropped, skip as many lines as we need, assuming
-         * the calibration frames are always full-resolution.
-         * Offset file pointer if frame is cropped to only load needed part of ref frame. */
-        if (!meta_ysize)
-        {
-            meta_ysize = height - meta_ystart;
-        }
-        height = meta_ysize;
+/**
+ * Calibration store (calib-xN.bin, created with --calib-pack)
+ *
+ * All the calibration data for one gain, in a single file: reference frames
+ * (16-bit, same values as in the PGM files), hot pixel index and compiled LUT.
+ * Native byte order, every plane page-aligned, so the file is just mapped
+ * into memory; a cropped frame is a pointer offset into the mapping.
+ *
+ * Planes are looked up by the name of the original file, so the store can
+ * stand in for any of them. If any of the packed files was modified after
+ * packing, the whole store is ignored.
+ */
+#define CALIB_MAGIC "R2DCAL1"
+#define CALIB_BYTE_ORDER 0x01020304
+#define CALIB_PAGE 4096
+#define CALIB_MAX_PLANES 8
 
-        if ( fseek(fp, width * meta_ystart * 2, SEEK_CUR) != 0 ) {
-            printf("Failed to set reference file offset\n");
-            exit(1);
-        }
-    }
+#define CALIB_PLANE_FRAME   1       /* uint16_t pixels[height][width] */
+#define CALIB_PLANE_HOTPIX  2       /* struct hot_pixel[count], full-frame coordinates */
+#define CALIB_PLANE_LUT     3       /* struct compiled_lut */
 
+struct calib_plane
+{
+    char name[32];                  /* original file, e.g. darkframe-x1.pgm */
+    uint32_t type;
+    uint32_t width;
+    uint32_t height;
+    uint32_t count;
+    uint64_t offset;                /* from the start of the file, multiple of CALIB_PAGE */
+    uint64_t size;
+    uint64_t checksum;              /* FNV-1a of the data */
+    int64_t mtime;                  /* of the original file, in ns */
+};
 
-    if (width != raw_info->width || height != raw_info->height)
-    {
-        printf("%s: size mismatch, expected %dx%d, got %dx%d.\n",
-            filename, raw_info->width, raw_info->height, width, height
-        );
-        exit(1);
-    }
+struct calib_header
+{
+    char magic[8];
+    uint32_t byte_order;            /* CALIB_BYTE_ORDER, in native byte order */
+    uint32_t header_size;
+    int32_t gain;
+    int32_t width;                  /* of the reference frames */
+    int32_t height;
+    int32_t darkframe_offset;
+    int32_t dcnuframe_offset;
+    int32_t dcnuframe_scaling;
+    int32_t gainframe_scaling;
+    int32_t num_planes;
+    struct calib_plane planes[CALIB_MAX_PLANES];
+    uint64_t checksum;              /* FNV-1a of the header, up to this field */
+};
 
-    int size = fread(buf, 1, width * height * 2, fp);
-    CHECK(size == width * height * 2, "fread");
-    fclose(fp);
+static struct
+{
+    int opened;
+    int gain;
+    uint8_t * map;                  /* null if there is no (valid) store for this gain */
+    size_t size;
+} calib_store;
 
-    /* PGM is big endian, need to reverse it */
-    reverse_bytes_order((void*)buf, width * height * 2);
-}
+/* incremented whenever a mapping is released; reference frames cached
+ * as pointers into the store are reloaded after that (see ref_key_update) */
+static int calib_store_generation = 0;
 
-static void subtract_dark_frame(struct raw_info * raw_info, int16_t * raw16, int16_t * darkframe, int16_t extra_offset, int16_t * darkcurrent_frame, float meta_expo)
+static uint64_t hash_buffer(const void * data, size_t size)
 {
-    /* note: data in dark frames is multiplied by 8 (already done when promoting to raw16)
-     * and offset by DARKFRAME_OFFSET, to allow corrections below black level */
-    int w = raw_info->width;
-    int h = raw_info->height;
-    int dark_current = extra_offset;
-
-    for (int y = 0; y < h; y++)
+    /* FNV-1a */
+    const uint8_t * p = data;
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (size_t i = 0; i < size; i++)
     {
-        for (int x = 0; x < w; x++)
-        {
-            int i = x + y*w;
-
-            if (darkcurrent_frame)
-            {
-                float dc = (float) (darkcurrent_frame[i] - DCNUFRAME_OFFSET) * 8 / DCNUFRAME_SCALING;
-                dark_current = (int)roundf(dc * meta_expo);
-            }
-
-            if (x >= 8 && x < w - 8)
-            {
-                /* for the active area, subtract the dark frame (constant offset)
-                 * and the dark current (exposure-dependent offset) */
-                raw16[i] -= (darkframe[i] - DARKFRAME_OFFSET + dark_current);
-            }
-            else
-            {
-                /* for black columns, subtract only the dark frame, not the dark current
-                 * (because that's how we define the dark current: the dark frame variation
-                 * with exposure after subtracting the black columns) */
-                raw16[i] -= (darkframe[i] - DARKFRAME_OFFSET);
-            }
-        }
+        hash = (hash ^ p[i]) * 0x100000001B3ull;
     }
+    return hash;
 }
 
-static float measure_hot_pixels(struct raw_info * raw_info, int16_t * raw16, int16_t * darkcurrent)
+static int64_t file_mtime(char * filename)
 {
-    int hotpixels[512];
-    int num_hotpix = 0;
+    struct stat st;
+    if (stat(filename, &st)) return -1;
+    return (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
 
-    /* identify hot pixels from dark current frame */
-    /* average value is 0.06 DN/ms; only select pixels with much higher dark currents */
-    int thr = 0.5 * DCNUFRAME_SCALING + DCNUFRAME_OFFSET;
+/* returns 0 if the store can be used, or the reason why not */
+static char * calib_store_check(uint8_t * map, size_t size, int gain)
+{
+    static char msg[64];
+    struct calib_header * hdr = (struct calib_header *) map;
 
-    int w = raw_info->width;
-    int h = raw_info->height;
-    for (int y = 50; y < h-50; y++)
+    if (size < sizeof(*hdr) || memcmp(hdr->magic, CALIB_MAGIC, sizeof(hdr->magic)) ||
+        hdr->byte_order != CALIB_BYTE_ORDER || hdr->header_size != sizeof(*hdr) ||
+        hdr->checksum != hash_buffer(hdr, offsetof(struct calib_header, checksum)) ||
+        hdr->num_planes < 0 || hdr->num_planes > CALIB_MAX_PLANES)
     {
-        for (int x = 50; x < w-50; x++)
-        {
-            if (darkcurrent[x + y*w] > thr && num_hotpix < COUNT(hotpixels))
-            {
-                hotpixels[num_hotpix++] = x + y*w;
-            }
-        }
+        return "not valid";
     }
 
-    //~ printf("%d hot pixels, ", num_hotpix);
+    if (hdr->gain != gain ||
+        hdr->darkframe_offset  != DARKFRAME_OFFSET  ||
+        hdr->dcnuframe_offset  != DCNUFRAME_OFFSET  ||
+        hdr->dcnuframe_scaling != DCNUFRAME_SCALING ||
+        hdr->gainframe_scaling != GAINFRAME_SCALING)
+    {
+        return "has different scaling constants";
+    }
 
-    int mags[512];
-    for (int i = 0; i < num_hotpix; i++)
+    for (int i = 0; i < hdr->num_planes; i++)
     {
-        int k = hotpixels[i];
-        int pr = raw16[k];              /* hot pixel from current image */
-        int pd = darkcurrent[k];        /* hot pixel from dark current frame */
-        int nr = 0;                     /* neighbour average from current image */
-        int nd = 0;                     /* neighbour average from dark current frame */
-        for (int dy = -1; dy <= 1; dy++)
+        struct calib_plane * p = &hdr->planes[i];
+        if (p->offset % CALIB_PAGE || p->offset + p->size > size)
         {
-            for (int dx = -1; dx <= 1; dx++)
-            {
-                if (dx || dy)
-                {
-                    nr += raw16[k + dx*2 + dy*2*w];
-                    nd += darkcurrent[k + dx*2 + dy*2*w];
-                }
-            }
+            return "is truncated";
         }
 
-        /* scaling factor between measured and reference intensity of the hot pixel */
-        /* where "intensity" of a hot pixel is its value minus the average of its 8 neighbours
-         * from the same color channel */
-        double ref = pd * 8 - nd;
-        double meas = (pr * 8 - nr);
-        mags[i] = round(meas * (8192/8) * DCNUFRAME_SCALING / ref);
+        int64_t mtime = file_mtime(p->name);
+        if (mtime >= 0 && mtime != p->mtime)
+        {
+            snprintf(msg, sizeof(msg), "is out of date (%.32s)", p->name);
+            return msg;
+        }
     }
 
-    float intensity = median_int_wirth(mags, num_hotpix) / 8192.0;
-
-    return intensity;
+    return 0;
 }
 
-static void apply_gain_frame(struct raw_info * raw_info, int16_t * raw16, uint16_t * dark)
+static void calib_store_close()
 {
-    int black = raw_info->black_level;
-    int n = raw_info->width * raw_info->height;
-    for (int i = 0; i < n; i++)
+    if (calib_store.map)
+    {
+        munmap(calib_store.map, calib_store.size);
+        calib_store_generation++;
+    }
+
+    if (compiled_lut_mapped == 2)
     {
-        raw16[i] = MIN((int64_t)(raw16[i] - black) * dark[i] / GAINFRAME_SCALING + black, 32760);
+        /* the LUT was inside the store */
+        compiled_lut = 0;
+        compiled_lut_mapped = 0;
     }
+
+    memset(&calib_store, 0, sizeof(calib_store));
 }
 
-static void apply_clip_frame(struct raw_info * raw_info, int16_t * raw16, uint16_t * clip)
+/* map calib-xN.bin, if any (once per gain) */
+static void calib_store_open(int gain)
 {
-    /* todo: use median? */
-    double clip_avg = 0;
-    int w = raw_info->width;
-    int h = raw_info->height;
-
-    for (int y = 0; y < h; y++)
+    if (calib_store.opened && calib_store.gain == gain)
     {
-        for (int x = 8; x < w-8; x++)
-        {
-            clip_avg += clip[x + y*w];
-        }
+        return;
     }
-    clip_avg /= (w - 16) * h;
 
-    /* fixme: magic numbers hardcoded for gain x1 */
-    int n = raw_info->width * raw_info->height;
-    for (int i = 0; i < n; i++)
+    calib_store_close();
+    calib_store.opened = 1;
+    calib_store.gain = gain;
+
+    char filename[32];
+    snprintf(filename, sizeof(filename), "calib-x%d.bin", gain);
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    uint8_t * map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
     {
-        if (raw16[i] > 2500 * 8)
-        {
-            /* subtract clip frame from clipped highlights, preserving the average value */
-            raw16[i] -= clip[i] - clip_avg;
-        }
-        else if (raw16[i] > 2000 * 8)
-        {
-            /* transition to clipped highlights (not sure it's the right way, but...) */
-            raw16[i] -= (clip[i] - clip_avg) * 500 / (raw16[i] - 2000);
-        }
+        map = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
     }
-}
+    close(fd);
 
-/* linear interpolation between lut[0] and lut[N] (including N)*/
-static void interp1(int16_t* lut, int N)
-{
-    int a = lut[0];
-    int b = lut[N];
-    for (int i = 1; i < N; i++)
+    char * problem = (map == MAP_FAILED) ? "not valid" : calib_store_check(map, st.st_size, gain);
+    if (problem)
     {
-        double k = (double) i / N;
-        lut[i] = round(a * (1-k) + b * k);
+        printf("Calib store : %s %s, ignored\n", filename, problem);
+        if (map != MAP_FAILED) munmap(map, st.st_size);
+        return;
     }
-}
 
+    calib_store.map = map;
+    calib_store.size = st.st_size;
+    printf("Calib store : %s (%d planes)\n", filename, ((struct calib_header *) map)->num_planes);
+}
 
-static void read_lut(char * filename)
+static const struct calib_plane * calib_store_find(char * filename)
 {
-    /* Header looks like this:
-     *
-     * Version 1
-     * From 0.0 1.0
-     * Length 256
-     * Components 3
-     */
-
-    FILE* f = fopen(filename, "r");
-    CHECK(f, "lut file");
-
-    int version=0, length=0, components=0;
-    float from_lo=0, from_hi=0;
-    CHECK(fscanf(f, "Version %d\n", &version)           == 1,   "ver"    );
-    CHECK(fscanf(f, "From %f %f\n", &from_lo, &from_hi) == 2,   "from"   );
-    CHECK(fscanf(f, "Length %d\n", &length)             == 1,   "len"    );
-    CHECK(fscanf(f, "Components %d\n", &components)     == 1,   "comp"   );
-    CHECK(fscanf(f, "{\n")                              == 0,   "{"      );
-    CHECK(version                                       == 1,   "ver1"   );
-    CHECK(from_lo                                       == 0.0, "from_lo");
-    CHECK(from_hi                                       == 1.0, "from_hi");
+    if (!calib_store.map)
+    {
+        return 0;
+    }
 
-    printf("%dx%d\n", components, length);
-    for (int i = 0; i < length; i++)
+    struct calib_header * hdr = (struct calib_header *) calib_store.map;
+    for (int i = 0; i < hdr->num_planes; i++)
     {
-        float r,g1,g2,b;
-        switch (components)
+        if (strncmp(hdr->planes[i].name, filename, sizeof(hdr->planes[i].name)) == 0)
         {
-            case 1:
-                CHECK(fscanf(f, "%f\n", &r), "data");
-                g1 = g2 = b = r;
-                break;
-            case 3:
-                CHECK(fscanf(f, "%f %f %f\n", &r, &g1, &b) == 3, "data");
-                g2 = g1;
-                break;
-            case 4:
-                CHECK(fscanf(f, "%f %f %f %f\n", &r, &g1, &g2, &b) == 4, "data");
-                break;
-            default:
-                printf("components error\n");
-                exit(1);
+            return &hdr->planes[i];
         }
+    }
+    return 0;
+}
 
-        CHECK(r  >= 0 && r  <= 1, "R range");
-        CHECK(g1 >= 0 && g1 <= 1, "G1 range");
-        CHECK(g2 >= 0 && g2 <= 1, "G2 range");
-        CHECK(b  >= 0 && b  <= 1, "B range");
+static const void * calib_store_data(const struct calib_plane * plane)
+{
+    return calib_store.map + plane->offset;
+}
 
-        int this = i * (4096*8-1) / (length-1);
+static int file_exists_warn(char * filename)
+{
+    int ans = file_exists(filename) || calib_store_find(filename);
+    if (!ans) printf("Not found   : %s\n", filename);
+    return ans;
+}
 
-        Lut_R [this] = (int) round(r  * 4096 * 8);
-        Lut_G1[this] = (int) round(g1 * 4096 * 8);
-        Lut_G2[this] = (int) round(g2 * 4096 * 8);
-        Lut_B [this] = (int) round(b  * 4096 * 8);
+/**
+ * Readout geometry of the image, relative to the full-resolution calibration frames:
+ * - Y windows (CMV12000 registers 2-65), in readout order; sizes are in sensor rows
+ * - X crop (--xstart); the sensor always reads full rows
+ * - subsampling and binning (register 68), in Bayer pairs: with subsampling,
+ *   Sub_offset rows are skipped at the top of each window, then the sensor reads
+ *   two rows and skips Sub_step rows (two columns read, two skipped);
+ *   with binning, each pixel is averaged with the skipped ones of the same color (2x2).
+ *
+ * Calibration frames are always full-resolution. For each geometry, the matching
+ * rows and columns are gathered once (frame view); users of the reference frames
+ * keep the result until the geometry changes (see ref_key).
+ */
+#define MAX_Y_WINDOWS 32
 
-        int prev = (i-1) * (4096*8-1) / (length-1);;
+struct frame_geometry
+{
+    int num_windows;                    /* 0 = full frame */
+    int ystart[MAX_Y_WINDOWS];
+    int ysize[MAX_Y_WINDOWS];           /* 0 = until the end of the frame */
+    int xstart;
+    int sub;
+    int sub_offset;
+    int sub_step;
+    int bin;
+};
 
-        if (prev >= 0)
-        {
-            interp1(Lut_R  + prev, this - prev);
-            interp1(Lut_G1 + prev, this - prev);
-            interp1(Lut_G2 + prev, this - prev);
-            interp1(Lut_B  + prev, this - prev);
-        }
-    }
-    CHECK(fscanf(f, "}\n")                              == 0,   "}"      );
-    fclose(f);
+struct frame_view
+{
+    struct frame_geometry geom;
+    int full_width;                     /* calibration frames */
+    int full_height;
+    int width;                          /* image */
+    int height;
+    int * rows;                         /* full-resolution row of each image row (first one, if binned) */
+    int * cols;                         /* full-resolution column of each image column */
+    int * row_inv;                      /* image row of each full-resolution row (-1 = not read out) */
+    int * col_inv;                      /* image column of each full-resolution column */
+    int row_min;                        /* rows needed from the calibration frames */
+    int row_max;                        /* (excluding row_max) */
+    int crop;                           /* plain vertical crop: first row (no gathering needed); -1 otherwise */
+};
 
-    if (0)
+#define FRAME_VIEW_CACHE 4
+
+/* appends the rows (or columns) read out from [start, end) to out[] (at most max); returns the new count */
+static int frame_view_add_range(int * out, int n, int max, int start, int end, struct frame_geometry * geom, int rows)
+{
+    /* binning always skips one pair (the one averaged in) */
+    int pairs = geom->sub || geom->bin;
+    int skip = (rows && !geom->bin) ? geom->sub_offset : 0;
+    int step = (rows && !geom->bin && geom->sub_step) ? geom->sub_step : 2;
+    int stride = pairs ? 2 + step : 1;
+    int last = geom->bin ? 3 : pairs ? 1 : 0;  /* last row used by each step */
+
+    for (int i = start + skip; i + last < end; i += stride)
     {
-        f = fopen("lut.m", "w");
-        fprintf(f, "lut = [\n");
-        for (int i = 0; i < 4096*8; i++)
+        for (int j = 0; j < (pairs ? 2 : 1); j++, n++)
         {
-            fprintf(f, "%d %d %d %d\n", Lut_R[i], Lut_G1[i], Lut_G2[i], Lut_B[i]);
+            if (n < max) out[n] = i + j;
         }
-        fprintf(f, "];");
-        fclose(f);
     }
+    return n;
 }
 
-static void apply_lut(struct raw_info * raw_info, int16_t * raw16)
+/* the view is computed once for each geometry and frame size (filename is only for error messages) */
+static struct frame_view * frame_view_get(char * filename, struct raw_info * raw_info, struct frame_geometry * geom, int full_width, int full_height)
 {
+    static struct frame_view cache[FRAME_VIEW_CACHE];
+    static int next = 0;
+
     int w = raw_info->width;
     int h = raw_info->height;
 
-    for (int y = 0; y < h; y++)
+    for (int i = 0; i < FRAME_VIEW_CACHE; i++)
     {
-        for (int x = 0; x < w; x += 2)
+        struct frame_view * v = &cache[i];
+        if (v->rows && v->width == w && v->height == h &&
+            v->full_width == full_width && v->full_height == full_height &&
+            memcmp(&v->geom, geom, sizeof(*geom)) == 0)
         {
-            /* Bayer pattern: [G2 B; R G1] */
-            /* a and b can be either G2B (even lines) or RG1 (odd lines) */
-            /* the LUTs already multiply the input values by 8 */
-            int a = raw16[x   + y*w];
-            int b = raw16[x+1 + y*w];
-            a = (y % 2) ? Lut_R [a] : Lut_G2[a];
-            b = (y % 2) ? Lut_G1[b] : Lut_B [b];
-            raw16[x   + y*w] = MIN(a, 32760);
-            raw16[x+1 + y*w] = MIN(b, 32760);
+            return v;
         }
     }
-}
 
-/* unpack raw data from 12-bit to 16-bit */
-/* this also promotes the data to 15-bit,
- * so we can use int16_t for processing */
-static void unpack12(struct raw_info * raw_info, int16_t * raw16)
-{
-    for (int y = 0; y < raw_info->height; y++)
+    struct frame_view * v = &cache[next];
+    next = (next + 1) % FRAME_VIEW_CACHE;
+
+    free(v->rows); free(v->cols);
+    free(v->row_inv); free(v->col_inv);
+
+    *v = (struct frame_view) {
+        .geom           = *geom,
+        .full_width     = full_width,
+        .full_height    = full_height,
+        .width          = w,
+        .height         = h,
+        .rows           = malloc(h * sizeof(v->rows[0])),
+        .cols           = malloc(w * sizeof(v->cols[0])),
+        .row_inv        = malloc(full_height * sizeof(v->row_inv[0])),
+        .col_inv        = malloc(full_width * sizeof(v->col_inv[0])),
+        .crop           = -1,
+    };
+    CHECK(v->rows && v->cols && v->row_inv && v->col_inv, "malloc");
+
+    int num_rows = 0;
+    for (int k = 0; k < MAX(geom->num_windows, 1); k++)
     {
-        for (int x = 0; x < raw_info->width; x += 2)
-        {
-            struct raw12_twopix * p = (struct raw12_twopix *)(raw_info->buffer + y * raw_info->pitch + x * sizeof(struct raw12_twopix) / 2);
-            unsigned a = (p->a_hi << 4) | p->a_lo;
-            unsigned b = (p->b_hi << 8) | p->b_lo;
-            unsigned w = raw_info->width;
-            raw16[x + y*w] = a << 3;
-            raw16[x + 1 + y*w] = b << 3;
-        }
+        int y0 = geom->ystart[k];
+        int y1 = geom->ysize[k] ? MIN(y0 + geom->ysize[k], full_height) : full_height;
+        num_rows = frame_view_add_range(v->rows, num_rows, h, y0, y1, geom, 1);
     }
-}
 
-static void linear_fit(float* x, float* y, int n, float* a, float* b)
-{
-    /**
-     * plain least squares
-     * y = ax + b
-     * a = (mean(xy) - mean(x)mean(y)) / (mean(x^2) - mean(x)^2)
-     * b = mean(y) - a mean(x)
-     */
+    /* the image may be narrower than the calibration frames (cropped at the right side) */
+    int num_cols = frame_view_add_range(v->cols, 0, w, geom->xstart, full_width, geom, 0);
 
-    double mx = 0, my = 0, mxy = 0, mx2 = 0;
-    for (int i = 0; i < n; i++)
+    if (num_rows != h || num_cols < w)
     {
-        mx += x[i];
-        my += y[i];
+        printf("%s: size mismatch, expected %dx%d, got %dx%d.\n",
+            filename, w, h, num_cols, num_rows
+        );
+        exit(1);
+    }
+
+    int extra = geom->bin ? 2 : 0;
+    memset(v->row_inv, -1, full_height * sizeof(v->row_inv[0]));
+    memset(v->col_inv, -1, full_width * sizeof(v->col_inv[0]));
+
+    v->row_min = full_height;
+    int contiguous = 1;
+    for (int y = 0; y < h; y++)
+    {
+        int r = v->rows[y];
+        v->row_inv[r] = v->row_inv[r + extra] = y;
+        v->row_min = MIN(v->row_min, r);
+        v->row_max = MAX(v->row_max, r + extra + 1);
+        contiguous &= (r == v->rows[0] + y);
+    }
+
+    for (int x = 0; x < w; x++)
+    {
+        int c = v->cols[x];
+        v->col_inv[c] = v->col_inv[c + extra] = x;
+    }
+
+    if (contiguous && !geom->sub && !geom->bin && !geom->xstart && w == full_width)
+    {
+        v->crop = v->rows[0];
+    }
+
+    return v;
+}
+
+/* image-sized view of a full-resolution frame; src starts at row view->row_min */
+static void frame_view_gather(struct frame_view * view, const uint16_t * src, uint16_t * out)
+{
+    int w = view->width;
+    int fw = view->full_width;
+    int * cols = view->cols;
+
+    PARALLEL_FOR
+    for (int y = 0; y < view->height; y++)
+    {
+        const uint16_t * s = src + (view->rows[y] - view->row_min) * fw;
+        uint16_t * o = out + y * w;
+
+        if (view->geom.bin)
+        {
+            /* average of 4 pixels of the same color */
+            for (int x = 0; x < w; x++)
+            {
+                int c = cols[x];
+                o[x] = (s[c] + s[c + 2] + s[c + 2*fw] + s[c + 2 + 2*fw] + 2) / 4;
+            }
+        }
+        else if (view->geom.sub)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                o[x] = s[cols[x]];
+            }
+        }
+        else
+        {
+            memcpy(o, s + cols[0], w * sizeof(o[0]));
+        }
+    }
+}
+
+/* rows of each Y window in the image (stacked in readout order); returns the number of windows */
+static int frame_geometry_windows(struct frame_geometry * geom, int height, int * first, int * count)
+{
+    int n = MAX(geom->num_windows, 1);
+    int rows = 0;
+
+    for (int k = 0; k < n; k++)
+    {
+        int y0 = geom->ystart[k];
+        first[k] = rows;
+        count[k] = geom->ysize[k] ? frame_view_add_range(0, 0, 0, y0, y0 + geom->ysize[k], geom, 1) : height - rows;
+        rows += count[k];
+
+        if (count[k] % 2)
+        {
+            printf("Y window %-3d: odd number of rows (%d), Bayer pattern will shift\n", k + 1, count[k]);
+        }
+    }
+
+    if (rows != height)
+    {
+        printf("Y windows   : %d rows in metadata, %d in image; ignored\n", rows, height);
+        first[0] = 0;
+        count[0] = height;
+        return 1;
+    }
+
+    return n;
+}
+
+/* position of each window when stitched at its place on the sensor (gaps included); returns the stitched height */
+static int frame_geometry_stitch(struct frame_geometry * geom, int num_windows, int * count, int * pos)
+{
+    int top = geom->ystart[0];
+    for (int k = 0; k < num_windows; k++)
+    {
+        top = MIN(top, geom->ystart[k]);
+    }
+
+    int height = 0;
+    for (int k = 0; k < num_windows; k++)
+    {
+        /* as many rows as a single window would have, down to this one (even, to keep the Bayer pattern) */
+        pos[k] = frame_view_add_range(0, 0, 0, top, geom->ystart[k], geom, 1) & ~1;
+        height = MAX(height, pos[k] + count[k]);
+    }
+
+    return height;
+}
+
+/* black reference columns read out in the image (see black_cols);
+ * full_width: width of the calibration frames (0 = unknown; assume the image reaches the right edge of the sensor) */
+static void black_columns_update(struct frame_geometry * geom, int width, int full_width)
+{
+    int pairs = geom->sub || geom->bin;
+    int extra = geom->bin ? 2 : 0;
+
+    if (!full_width)
+    {
+        /* with pairs, two columns are read out of every four */
+        full_width = geom->xstart + (pairs ? 2 * width : width);
+    }
+
+    int cols[width];
+    int n = MIN(frame_view_add_range(cols, 0, width, geom->xstart, full_width, geom, 0), width);
+
+    /* a binned column is black only if all of its source columns are */
+    int left = 0;
+    while (left < n && cols[left] + extra < BLACK_COLUMNS)
+    {
+        left++;
+    }
+
+    int right = 0;
+    while (right < n - left && cols[n - 1 - right] >= full_width - BLACK_COLUMNS)
+    {
+        right++;
+    }
+
+    /* the image may be narrower than the readout (cropped at the right side) */
+    black_cols.left = left;
+    black_cols.right = (n == width) ? right : 0;
+}
+
+/* Bayer pattern of the image: the full-resolution one, shifted if the readout
+ * starts at an odd row or column (subsampling and binning keep the pattern) */
+static int frame_geometry_cfa(struct frame_geometry * geom, int cfa_pattern)
+{
+    int y0 = geom->ystart[0] + ((geom->sub && !geom->bin) ? geom->sub_offset : 0);
+    int x0 = geom->xstart;
+
+    /* one byte per pixel: (0,0), (1,0), (0,1), (1,1) */
+    if (y0 % 2)
+    {
+        cfa_pattern = ((cfa_pattern >> 16) & 0x0000FFFF) | ((cfa_pattern << 16) & 0xFFFF0000);
+    }
+    if (x0 % 2)
+    {
+        cfa_pattern = ((cfa_pattern >> 8) & 0x00FF00FF) | ((cfa_pattern << 8) & 0xFF00FF00);
+    }
+
+    return cfa_pattern;
+}
+
+/* view for a reference frame, without loading it */
+static struct frame_view * reference_frame_view(char * filename, struct raw_info * raw_info, struct frame_geometry * geom)
+{
+    int width, height;
+    const struct calib_plane * plane = calib_store_find(filename);
+    if (plane && plane->type == CALIB_PLANE_FRAME)
+    {
+        width = plane->width;
+        height = plane->height;
+    }
+    else
+    {
+        fclose(open_pgm(filename, &width, &height));
+    }
+
+    return frame_view_get(filename, raw_info, geom, width, height);
+}
+
+/* for dark frames, clip frames, gray frames, stuff like that */
+/* returns the reference frame for the image geometry, from full-resolution calibration frames;
+ * without a copy if the frame is in the calibration store and the image is only cropped vertically */
+/* *buf is allocated only when needed (free it afterwards) */
+static const uint16_t * get_reference_frame(char* filename, uint16_t ** buf, struct raw_info * raw_info, struct frame_geometry * geom)
+{
+    *buf = 0;
+
+    int n = raw_info->width * raw_info->height;
+    const struct calib_plane * plane = calib_store_find(filename);
+
+    if (plane && plane->type == CALIB_PLANE_FRAME)
+    {
+        const uint16_t * mapped = calib_store_data(plane);
+        struct frame_view * view = frame_view_get(filename, raw_info, geom, plane->width, plane->height);
+
+        if (view->crop >= 0)
+        {
+            return mapped + view->crop * view->full_width;
+        }
+
+        *buf = malloc(n * sizeof((*buf)[0]));
+        CHECK(*buf, "malloc");
+        frame_view_gather(view, mapped + view->row_min * view->full_width, *buf);
+        return *buf;
+    }
+
+    int width, height;
+    FILE* fp = open_pgm(filename, &width, &height);
+    struct frame_view * view = frame_view_get(filename, raw_info, geom, width, height);
+
+    /* only load the rows we need */
+    int rows = view->row_max - view->row_min;
+    uint16_t * src = malloc(rows * width * sizeof(src[0]));
+    CHECK(src, "malloc");
+
+    if ( fseek(fp, (long) width * view->row_min * 2, SEEK_CUR) != 0 ) {
+        printf("Failed to set reference file offset\n");
+        exit(1);
+    }
+
+    int size = fread(src, 1, rows * width * 2, fp);
+    CHECK(size == rows * width * 2, "fread");
+    fclose(fp);
+
+    /* PGM is big endian, need to reverse it */
+    reverse_bytes_order((void*)src, rows * width * 2);
+
+    if (view->crop >= 0)
+    {
+        *buf = src;
+        return src;
+    }
+
+    *buf = malloc(n * sizeof((*buf)[0]));
+    CHECK(*buf, "malloc");
+    frame_view_gather(view, src, *buf);
+    free(src);
+    return *buf;
+}
+
+/* multiply a raw16 pixel by a gain frame value (fixed point, 1.0 = GAINFRAME_SCALING), preserving black level */
+/* rounds to nearest; the old (int64_t) division rounded towards zero, so results may differ by 1 (raw16 units) */
+/* written with 32-bit intermediates, so it can be vectorized */
+static inline int16_t apply_gain_pixel(int16_t raw, uint16_t gain, int black)
+{
+    /* clamping to int16 keeps the product within int32 */
+    int32_t p = COERCE(raw - black, -32768, 32767);
+    int32_t out = ((p * gain + GAINFRAME_SCALING/2) >> 14) + black;
+    return COERCE(out, -32768, 32760);
+}
+
+/* reference frames are kept in memory between input files,
+ * and reloaded only if the file name or the frame geometry changes (or calib-xN.bin is unmapped) */
+struct ref_key
+{
+    char filename[32];
+    int width;
+    int height;
+    struct frame_geometry geom;
+    int store_generation;       /* the frame may point into calib-xN.bin */
+};
+
+/* returns 1 if the key was changed (i.e. the reference frame must be reloaded) */
+static int ref_key_update(struct ref_key * key, char * filename, struct raw_info * raw_info, struct frame_geometry * geom)
+{
+    struct ref_key new_key = {
+        .width  = raw_info->width,
+        .height = raw_info->height,
+        .geom   = *geom,
+        .store_generation = calib_store_generation,
+    };
+    snprintf(new_key.filename, sizeof(new_key.filename), "%s", filename ? filename : "");
+
+    if (memcmp(key, &new_key, sizeof(new_key)) == 0)
+    {
+        return 0;
+    }
+
+    *key = new_key;
+    return 1;
+}
+
+/**
+ * Dark frame correction engine.
+ *
+ * The offset subtracted from each pixel is A + B * t, where:
+ * - A is the dark frame, without DARKFRAME_OFFSET (bias)
+ * - B is the dark current frame, without DCNUFRAME_OFFSET (slope)
+ * - t is the exposure time (or the scaling factor measured from hot pixels)
+ *
+ * A and B are kept in separate planes (SoA); for each new value of t,
+ * they are combined into one offset plane, in fixed point, and reused
+ * for all consecutive frames with the same exposure. Subtracting
+ * the dark frame is then a plain, branch-free vector subtraction.
+ */
+static struct
+{
+    struct ref_key dark_key;
+    struct ref_key dcnu_key;
+    int16_t * bias;             /* A: DN x 8 */
+    int32_t * slope;            /* B: DN x 8 / ms, scaled by DCNUFRAME_SCALING / 8 */
+    int16_t * combined;         /* A + B * t in the active area, A in black columns */
+    int combined_valid;
+    int64_t combined_expo;      /* t used for the combined plane (ms, Q16 fixed point) */
+    int combined_extra;         /* constant dark current used instead of B (if B is not present) */
+} dark_engine;
+
+static void dark_engine_load(struct raw_info * raw_info, char * dark_filename, char * dcnu_filename, struct frame_geometry * geom)
+{
+    int n = raw_info->width * raw_info->height;
+
+    if (ref_key_update(&dark_engine.dark_key, dark_filename, raw_info, geom))
+    {
+        free(dark_engine.bias);
+        free(dark_engine.combined);
+        dark_engine.bias = malloc(n * sizeof(dark_engine.bias[0]));
+        dark_engine.combined = malloc(n * sizeof(dark_engine.combined[0]));
+        CHECK(dark_engine.bias && dark_engine.combined, "malloc");
+
+        uint16_t * buf;
+        const uint16_t * dark = get_reference_frame(dark_filename, &buf, raw_info, geom);
+
+        PARALLEL_FOR
+        for (int i = 0; i < n; i++)
+        {
+            dark_engine.bias[i] = dark[i] - DARKFRAME_OFFSET;
+        }
+
+        free(buf);
+
+        dark_engine.combined_valid = 0;
+    }
+
+    if (ref_key_update(&dark_engine.dcnu_key, dcnu_filename, raw_info, geom))
+    {
+        free(dark_engine.slope); dark_engine.slope = 0;
+
+        if (dcnu_filename)
+        {
+            /* note: dcnu frames are unsigned; hot pixels may exceed INT16_MAX */
+            dark_engine.slope = malloc(n * sizeof(dark_engine.slope[0]));
+            CHECK(dark_engine.slope, "malloc");
+
+            uint16_t * buf;
+            const uint16_t * dcnu = get_reference_frame(dcnu_filename, &buf, raw_info, geom);
+
+            PARALLEL_FOR
+            for (int i = 0; i < n; i++)
+            {
+                dark_engine.slope[i] = (int32_t) dcnu[i] - DCNUFRAME_OFFSET;
+            }
+
+            free(buf);
+        }
+
+        dark_engine.combined_valid = 0;
+    }
+}
+
+/* combine A and B planes into one offset plane, for exposure (or scaling factor) t */
+/* extra_offset: constant dark current, only used if there is no dark current frame */
+static void dark_engine_combine(struct raw_info * raw_info, float t, int extra_offset)
+{
+    int64_t tq = llround(t * 65536.0);
+
+    if (dark_engine.combined_valid && dark_engine.combined_expo == tq && dark_engine.combined_extra == extra_offset)
+    {
+        /* same exposure as previous frame, nothing to do */
+        return;
+    }
+
+    int w = raw_info->width;
+    int h = raw_info->height;
+
+    PARALLEL_FOR
+    for (int y = 0; y < h; y++)
+    {
+        int16_t * restrict out = dark_engine.combined + y*w;
+        int16_t * restrict a = dark_engine.bias + y*w;
+
+        /* for black columns, subtract only the dark frame, not the dark current
+         * (because that's how we define the dark current: the dark frame variation
+         * with exposure after subtracting the black columns) */
+        for (int x = 0; x < black_cols.left; x++)
+        {
+            out[x] = a[x];
+        }
+        for (int x = w - black_cols.right; x < w; x++)
+        {
+            out[x] = a[x];
+        }
+
+        /* for the active area, subtract the dark frame (constant offset)
+         * and the dark current (exposure-dependent offset) */
+        if (dark_engine.slope)
+        {
+            /* dark current = B * 8 / DCNUFRAME_SCALING * t = B * t / 1024, rounded;
+             * with t in Q16, that's a 26-bit shift */
+            int32_t * restrict b = dark_engine.slope + y*w;
+            for (int x = black_cols.left; x < w - black_cols.right; x++)
+            {
+                int64_t dc = (b[x] * tq + (1 << 25)) >> 26;
+                out[x] = COERCE(a[x] + dc, -32768, 32767);
+            }
+        }
+        else
+        {
+            for (int x = black_cols.left; x < w - black_cols.right; x++)
+            {
+                out[x] = COERCE(a[x] + extra_offset, -32768, 32767);
+            }
+        }
+    }
+
+    dark_engine.combined_expo = tq;
+    dark_engine.combined_extra = extra_offset;
+    dark_engine.combined_valid = 1;
+}
+
+/* note: data in dark frames is multiplied by 8 (already done when promoting to raw16)
+ * and offset by DARKFRAME_OFFSET, to allow corrections below black level */
+/* optionally applies the gain frame in the same pass (only valid if there is nothing to do in between) */
+static void subtract_dark_frame(struct raw_info * raw_info, int16_t * raw16, float t, int extra_offset, const uint16_t * gainframe)
+{
+    dark_engine_combine(raw_info, t, extra_offset);
+
+    int w = raw_info->width;
+    int h = raw_info->height;
+    int black = raw_info->black_level;
+
+    PARALLEL_FOR
+    for (int y = 0; y < h; y++)
+    {
+        int16_t * restrict row = raw16 + y*w;
+        int16_t * restrict off = dark_engine.combined + y*w;
+        for (int x = 0; x < w; x++)
+        {
+            row[x] -= off[x];
+        }
+
+        if (gainframe)
+        {
+            const uint16_t * restrict gain = gainframe + y*w;
+            for (int x = 0; x < w; x++)
+            {
+                row[x] = apply_gain_pixel(row[x], gain[x], black);
+            }
+        }
+    }
+}
+
+/**
+ * Hot pixel index, for scaling the dark current frame (--dchp).
+ *
+ * Hot pixels depend only on the dark current frame, so they are identified
+ * once, when loading the calibration data, and saved next to it
+ * (hotpixels-xN.txt), together with their reference intensities.
+ * Per frame, only these pixels are visited.
+ */
+struct hot_pixel
+{
+    int x;
+    int y;
+    int ref;                    /* reference intensity, from the dark current frame */
+};
+
+static struct
+{
+    struct hot_pixel * pixels;
+    int count;
+    struct ref_key dcnu_key;    /* dark current frame used to build the index */
+} hot_pixels;
+
+/* "intensity" of a hot pixel is its value minus the average of its 8 neighbours
+ * from the same color channel (computed x8) */
+#define HOT_PIXEL_INTENSITY(buf, k, w) ( 8 * (buf)[k] - (                     \
+    (buf)[(k) - 2 - 2*(w)] + (buf)[(k) - 2*(w)] + (buf)[(k) + 2 - 2*(w)] +    \
+    (buf)[(k) - 2        ]                      + (buf)[(k) + 2        ] +    \
+    (buf)[(k) - 2 + 2*(w)] + (buf)[(k) + 2*(w)] + (buf)[(k) + 2 + 2*(w)]      \
+))
+
+/* identify hot pixels from dark current frame (without DCNUFRAME_OFFSET) */
+static void hot_pixels_find(struct raw_info * raw_info, int32_t * darkcurrent)
+{
+    /* average value is 0.06 DN/ms; only select pixels with much higher dark currents */
+    int thr = 0.5 * DCNUFRAME_SCALING;
+
+    int w = raw_info->width;
+    int h = raw_info->height;
+    int allocated = 0;
+    hot_pixels.count = 0;
+
+    for (int y = 50; y < h-50; y++)
+    {
+        for (int x = 50; x < w-50; x++)
+        {
+            int k = x + y*w;
+            if (darkcurrent[k] > thr)
+            {
+                if (hot_pixels.count == allocated)
+                {
+                    allocated = MAX(allocated * 2, 1024);
+                    hot_pixels.pixels = realloc(hot_pixels.pixels, allocated * sizeof(hot_pixels.pixels[0]));
+                    CHECK(hot_pixels.pixels, "realloc");
+                }
+
+                struct hot_pixel * p = &hot_pixels.pixels[hot_pixels.count++];
+                p->x = x;
+                p->y = y;
+                p->ref = HOT_PIXEL_INTENSITY(darkcurrent, k, w);
+            }
+        }
+    }
+}
+
+/* keep a hot pixel from the index if it was read out, together with its neighbours */
+/* view: image geometry (0 = full resolution) */
+static void hot_pixels_keep(struct hot_pixel p, struct raw_info * raw_info, struct frame_view * view)
+{
+    if (view)
+    {
+        if (p.x < 2 || p.x >= view->full_width - 2 || p.y < 2 || p.y >= view->full_height - 2)
+        {
+            return;
+        }
+
+        int x = view->col_inv[p.x];
+        int y = view->row_inv[p.y];
+        if (x < 2 || x >= raw_info->width - 2 || y < 2 || y >= raw_info->height - 2)
+        {
+            return;
+        }
+
+        /* the neighbours must also be the same (e.g. not from another Y window) */
+        if (view->cols[x-2] != p.x-2 || view->cols[x+2] != p.x+2 ||
+            view->rows[y-2] != p.y-2 || view->rows[y+2] != p.y+2)
+        {
+            return;
+        }
+
+        p.x = x;
+        p.y = y;
+    }
+    else if (p.y < 2 || p.y >= raw_info->height - 2)
+    {
+        return;
+    }
+
+    hot_pixels.pixels[hot_pixels.count++] = p;
+}
+
+/* coordinates in the file are for the full-resolution calibration frame */
+static int hot_pixels_read(char * filename, struct raw_info * raw_info, struct frame_view * view)
+{
+    if (view && (view->geom.sub || view->geom.bin))
+    {
+        /* neighbours are no longer the same; the index must be rebuilt */
+        return 0;
+    }
+
+    int full_width = view ? view->full_width : raw_info->width;
+    int rows_needed = view ? view->row_max : raw_info->height;
+
+    const struct calib_plane * plane = calib_store_find(filename);
+    if (plane && plane->type == CALIB_PLANE_HOTPIX)
+    {
+        if ((int) plane->width != full_width || (int) plane->height < rows_needed)
+        {
+            return 0;
+        }
+
+        const struct hot_pixel * packed = calib_store_data(plane);
+        hot_pixels.pixels = realloc(hot_pixels.pixels, MAX(plane->count, 1) * sizeof(hot_pixels.pixels[0]));
+        CHECK(hot_pixels.pixels, "realloc");
+        hot_pixels.count = 0;
+
+        for (int i = 0; i < (int) plane->count; i++)
+        {
+            hot_pixels_keep(packed[i], raw_info, view);
+        }
+        return 1;
+    }
+
+    FILE* f = fopen(filename, "r");
+    if (!f) return 0;
+
+    int w, h, count;
+    if (fscanf(f, "# hot pixels: %d x %d, %d\n", &w, &h, &count) != 3 ||
+        w != full_width || h < rows_needed)
+    {
+        fclose(f);
+        return 0;
+    }
+
+    hot_pixels.pixels = realloc(hot_pixels.pixels, MAX(count, 1) * sizeof(hot_pixels.pixels[0]));
+    CHECK(hot_pixels.pixels, "realloc");
+    hot_pixels.count = 0;
+
+    /* skip hot pixels outside the cropped area (we need two more rows for neighbours) */
+    struct hot_pixel p;
+    for (int i = 0; i < count && fscanf(f, "%d %d %d\n", &p.x, &p.y, &p.ref) == 3; i++)
+    {
+        hot_pixels_keep(p, raw_info, view);
+    }
+
+    fclose(f);
+    return 1;
+}
+
+static void hot_pixels_save(char * filename, struct raw_info * raw_info)
+{
+    FILE* f = fopen(filename, "w");
+    CHECK(f, "could not open %s", filename);
+
+    fprintf(f, "# hot pixels: %d x %d, %d\n", raw_info->width, raw_info->height, hot_pixels.count);
+    for (int i = 0; i < hot_pixels.count; i++)
+    {
+        struct hot_pixel * p = &hot_pixels.pixels[i];
+        fprintf(f, "%d %d %d\n", p->x, p->y, p->ref);
+    }
+    fclose(f);
+}
+
+static int file_is_older(char * filename, char * reference)
+{
+    struct stat a, b;
+    if (stat(filename, &a) || stat(reference, &b)) return 1;
+    return a.st_mtime < b.st_mtime;
+}
+
+static void hot_pixels_load(char * filename, char * dcnu_filename, struct raw_info * raw_info, struct frame_geometry * geom)
+{
+    if (memcmp(&hot_pixels.dcnu_key, &dark_engine.dcnu_key, sizeof(hot_pixels.dcnu_key)) == 0)
+    {
+        /* same dark current frame as before */
+        return;
+    }
+
+    struct frame_view * view = reference_frame_view(dcnu_filename, raw_info, geom);
+
+    /* a packed index is always up to date (see calib_store_check) */
+    if ((!calib_store_find(filename) && file_is_older(filename, dcnu_filename)) ||
+        !hot_pixels_read(filename, raw_info, view))
+    {
+        hot_pixels_find(raw_info, dark_engine.slope);
+
+        /* save the index only if it covers the top of the calibration frame, at full resolution;
+         * if it doesn't cover the bottom, it will be rebuilt when needed */
+        if (view->crop == 0)
+        {
+            printf("Hot pixels  : %s (%d)\n", filename, hot_pixels.count);
+            hot_pixels_save(filename, raw_info);
+        }
+    }
+
+    hot_pixels.dcnu_key = dark_engine.dcnu_key;
+}
+
+/* scaling factor between measured and reference intensity of the hot pixels */
+/* returns NAN if there are no hot pixels */
+static float measure_hot_pixels(struct raw_info * raw_info, int16_t * raw16)
+{
+    int w = raw_info->width;
+    int n = hot_pixels.count;
+
+    if (n == 0)
+    {
+        return NAN;
+    }
+
+    int * mags = malloc(n * sizeof(mags[0]));
+    CHECK(mags, "malloc");
+
+    PARALLEL_FOR
+    for (int i = 0; i < n; i++)
+    {
+        int k = hot_pixels.pixels[i].x + hot_pixels.pixels[i].y * w;
+        double ref = hot_pixels.pixels[i].ref;
+        double meas = HOT_PIXEL_INTENSITY(raw16, k, w);
+        mags[i] = round(meas * (8192/8) * DCNUFRAME_SCALING / ref);
+    }
+
+    float intensity = median_int_wirth(mags, n) / 8192.0;
+    free(mags);
+
+    return intensity;
+}
+
+static void apply_gain_frame(struct raw_info * raw_info, int16_t * raw16, const uint16_t * gain)
+{
+    int black = raw_info->black_level;
+    int w = raw_info->width;
+    int h = raw_info->height;
+    PARALLEL_FOR
+    for (int y = 0; y < h; y++)
+    {
+        int16_t * restrict row = raw16 + y*w;
+        const uint16_t * restrict g = gain + y*w;
+        for (int x = 0; x < w; x++)
+        {
+            row[x] = apply_gain_pixel(row[x], g[x], black);
+        }
+    }
+}
+
+/* the gain frame is kept between input files, like the other reference frames */
+static struct
+{
+    struct ref_key key;
+    const uint16_t * data;
+    uint16_t * buf;             /* null if data is from the calibration store */
+} gain_frame;
+
+static const uint16_t * gain_frame_load(struct raw_info * raw_info, char * gain_filename, struct frame_geometry * geom)
+{
+    if (ref_key_update(&gain_frame.key, gain_filename, raw_info, geom))
+    {
+        free(gain_frame.buf);
+        gain_frame.data = get_reference_frame(gain_filename, &gain_frame.buf, raw_info, geom);
+    }
+
+    return gain_frame.data;
+}
+
+/**
+ * Gain frame as DNG GainMap opcodes (OpcodeList2), one for each CFA channel,
+ * downsampled to one map point every GAINMAP_SPACING pixels (averaged
+ * around each point). The raw developer applies it to black-subtracted data,
+ * same as apply_gain_frame, so the pixels can be copied without processing.
+ */
+#define GAINMAP_SPACING 32
+
+static struct
+{
+    struct ref_key key;
+    uint8_t * opcodes;          /* big endian */
+    int size;
+} gain_map;
+
+static uint8_t * put_be32(uint8_t * p, uint32_t v)
+{
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+    return p + 4;
+}
+
+static uint8_t * put_be_float(uint8_t * p, float v)
+{
+    uint32_t u; memcpy(&u, &v, 4);
+    return put_be32(p, u);
+}
+
+static uint8_t * put_be_double(uint8_t * p, double v)
+{
+    uint64_t u; memcpy(&u, &v, 8);
+    p = put_be32(p, u >> 32);
+    return put_be32(p, u);
+}
+
+static void gain_map_load(struct raw_info * raw_info, char * gain_filename, struct frame_geometry * geom)
+{
+    if (!ref_key_update(&gain_map.key, gain_filename, raw_info, geom))
+    {
+        /* already computed */
+        return;
+    }
+
+    int w = raw_info->width;
+    int h = raw_info->height;
+    uint16_t * buf;
+    const uint16_t * gain = get_reference_frame(gain_filename, &buf, raw_info, geom);
+
+    /* map points, in channel pixels (half resolution) */
+    int step = GAINMAP_SPACING / 2;
+    int cw = w / 2;
+    int ch = h / 2;
+    int points_h = (cw - 1 + step - 1) / step + 1;
+    int points_v = (ch - 1 + step - 1) / step + 1;
+    int opcode_params = 4 * 4 + 4 * 4 + 4 * 2 + 8 * 4 + 4 + points_v * points_h * 4;
+    int opcode_size = 16 + opcode_params;
+
+    free(gain_map.opcodes);
+    gain_map.size = 4 + 4 * opcode_size;
+    gain_map.opcodes = malloc(gain_map.size);
+    CHECK(gain_map.opcodes, "malloc");
+
+    uint8_t * p = put_be32(gain_map.opcodes, 4);    /* Count */
+
+    for (int dy = 0; dy < 2; dy++)
+    {
+        for (int dx = 0; dx < 2; dx++)
+        {
+            p = put_be32(p, 9);                     /* GainMap = 9 */
+            p = put_be32(p, 0x01030000);            /* DNG version = 1.3.0.0 */
+            p = put_be32(p, 1);                     /* Flags = 1 (optional) */
+            p = put_be32(p, opcode_params);         /* Opcode length */
+            p = put_be32(p, dy);                    /* Top */
+            p = put_be32(p, dx);                    /* Left */
+            p = put_be32(p, h);                     /* Bottom */
+            p = put_be32(p, w);                     /* Right */
+            p = put_be32(p, 0);                     /* Plane */
+            p = put_be32(p, 1);                     /* Planes */
+            p = put_be32(p, 2);                     /* RowPitch */
+            p = put_be32(p, 2);                     /* ColPitch */
+            p = put_be32(p, points_v);              /* MapPointsV */
+            p = put_be32(p, points_h);              /* MapPointsH */
+            p = put_be_double(p, (double) GAINMAP_SPACING / (h - dy));  /* MapSpacingV (relative) */
+            p = put_be_double(p, (double) GAINMAP_SPACING / (w - dx));  /* MapSpacingH (relative) */
+            p = put_be_double(p, 0);                /* MapOriginV */
+            p = put_be_double(p, 0);                /* MapOriginH */
+            p = put_be32(p, 1);                     /* MapPlanes */
+
+            /* average the gain frame around each map point (skipping black columns) */
+            for (int i = 0; i < points_v; i++)
+            {
+                for (int j = 0; j < points_h; j++)
+                {
+                    int64_t sum = 0;
+                    int num = 0;
+                    for (int y = MAX(i * step - step/2, 0); y < MIN(i * step + step/2, ch); y++)
+                    {
+                        for (int x = MAX(j * step - step/2, (black_cols.left + 1) / 2); x < MIN(j * step + step/2, cw - (black_cols.right + 1) / 2); x++)
+                        {
+                            sum += gain[(2*x + dx) + (2*y + dy) * w];
+                            num++;
+                        }
+                    }
+                    p = put_be_float(p, num ? (double) sum / num / GAINFRAME_SCALING : 1.0);
+                }
+            }
+        }
+    }
+
+    CHECK(p == gain_map.opcodes + gain_map.size, "gain map size");
+    free(buf);
+}
+
+
+/* fixme: magic numbers hardcoded for gain x1 */
+#define CLIP_TRANSITION_START (2000 * 8)
+#define CLIP_TRANSITION_END   (2500 * 8)
+
+/**
+ * Clip frame, preprocessed when loading:
+ * - mean-removed clip plane (the average value is preserved in highlights)
+ * - transition weights for each pixel value (1.0 = 1 << 15), from
+ *   0 below CLIP_TRANSITION_START to 1 above CLIP_TRANSITION_END.
+ * The per-frame correction is then a lookup and a multiplication.
+ */
+static struct
+{
+    struct ref_key key;
+    int16_t * delta;            /* clip frame minus its average */
+    int32_t weights[CLIP_TRANSITION_END - CLIP_TRANSITION_START + 2];
+} clip_frame;
+
+static void clip_frame_load(struct raw_info * raw_info, char * clip_filename, struct frame_geometry * geom)
+{
+    if (!ref_key_update(&clip_frame.key, clip_filename, raw_info, geom))
+    {
+        /* already loaded */
+        return;
+    }
+
+    int w = raw_info->width;
+    int h = raw_info->height;
+    int n = w * h;
+
+    free(clip_frame.delta);
+    clip_frame.delta = malloc(n * sizeof(clip_frame.delta[0]));
+    CHECK(clip_frame.delta, "malloc");
+
+    uint16_t * buf;
+    const uint16_t * clip = get_reference_frame(clip_filename, &buf, raw_info, geom);
+
+    /* todo: use median? */
+    int64_t clip_sum = 0;
+    PARALLEL_FOR_SUM(clip_sum)
+    for (int y = 0; y < h; y++)
+    {
+        for (int x = black_cols.left; x < w - black_cols.right; x++)
+        {
+            clip_sum += clip[x + y*w];
+        }
+    }
+    double clip_avg = (double) clip_sum / ((w - black_cols.left - black_cols.right) * h);
+
+    PARALLEL_FOR
+    for (int i = 0; i < n; i++)
+    {
+        clip_frame.delta[i] = COERCE(lround(clip[i] - clip_avg), -32768, 32767);
+    }
+    free(buf);
+
+    for (int i = 0; i < COUNT(clip_frame.weights); i++)
+    {
+        int v = i + CLIP_TRANSITION_START;
+        if (v > CLIP_TRANSITION_END)
+        {
+            /* clipped highlights: subtract the clip frame */
+            clip_frame.weights[i] = 1 << 15;
+        }
+        else if (v > CLIP_TRANSITION_START)
+        {
+            /* transition to clipped highlights (not sure it's the right way, but...) */
+            clip_frame.weights[i] = lround(500.0 * (1 << 15) / (v - 2000));
+        }
+        else
+        {
+            clip_frame.weights[i] = 0;
+        }
+    }
+}
+
+static void apply_clip_frame(struct raw_info * raw_info, int16_t * raw16)
+{
+    int n = raw_info->width * raw_info->height;
+    int16_t * restrict delta = clip_frame.delta;
+    int32_t * restrict weights = clip_frame.weights;
+
+    PARALLEL_FOR
+    for (int i = 0; i < n; i++)
+    {
+        /* branch-free: values outside the transition band map to the first or last weight */
+        int k = COERCE(raw16[i], CLIP_TRANSITION_START, CLIP_TRANSITION_END + 1) - CLIP_TRANSITION_START;
+        raw16[i] -= (delta[i] * weights[k] + (1 << 14)) >> 15;
+    }
+}
+
+/* linear interpolation between lut[0] and lut[N] (including N)*/
+static void interp1(int16_t* lut, int N)
+{
+    int a = lut[0];
+    int b = lut[N];
+    for (int i = 1; i < N; i++)
+    {
+        double k = (double) i / N;
+        lut[i] = round(a * (1-k) + b * k);
+    }
+}
+
+
+static void read_lut(char * filename, uint32_t * out_components, uint32_t * out_length)
+{
+    /* Header looks like this:
+     *
+     * Version 1
+     * From 0.0 1.0
+     * Length 256
+     * Components 3
+     */
+
+    FILE* f = fopen(filename, "r");
+    CHECK(f, "lut file");
+
+    int version=0, length=0, components=0;
+    float from_lo=0, from_hi=0;
+    CHECK(fscanf(f, "Version %d\n", &version)           == 1,   "ver"    );
+    CHECK(fscanf(f, "From %f %f\n", &from_lo, &from_hi) == 2,   "from"   );
+    CHECK(fscanf(f, "Length %d\n", &length)             == 1,   "len"    );
+    CHECK(fscanf(f, "Components %d\n", &components)     == 1,   "comp"   );
+    CHECK(fscanf(f, "{\n")                              == 0,   "{"      );
+    CHECK(version                                       == 1,   "ver1"   );
+    CHECK(from_lo                                       == 0.0, "from_lo");
+    CHECK(from_hi                                       == 1.0, "from_hi");
+
+    *out_components = components;
+    *out_length = length;
+
+    for (int i = 0; i < length; i++)
+    {
+        float r,g1,g2,b;
+        switch (components)
+        {
+            case 1:
+                CHECK(fscanf(f, "%f\n", &r), "data");
+                g1 = g2 = b = r;
+                break;
+            case 3:
+                CHECK(fscanf(f, "%f %f %f\n", &r, &g1, &b) == 3, "data");
+                g2 = g1;
+                break;
+            case 4:
+                CHECK(fscanf(f, "%f %f %f %f\n", &r, &g1, &g2, &b) == 4, "data");
+                break;
+            default:
+                printf("components error\n");
+                exit(1);
+        }
+
+        CHECK(r  >= 0 && r  <= 1, "R range");
+        CHECK(g1 >= 0 && g1 <= 1, "G1 range");
+        CHECK(g2 >= 0 && g2 <= 1, "G2 range");
+        CHECK(b  >= 0 && b  <= 1, "B range");
+
+        int this = i * (4096*8-1) / (length-1);
+
+        Lut_R [this] = (int) round(r  * 4096 * 8);
+        Lut_G1[this] = (int) round(g1 * 4096 * 8);
+        Lut_G2[this] = (int) round(g2 * 4096 * 8);
+        Lut_B [this] = (int) round(b  * 4096 * 8);
+
+        int prev = (i-1) * (4096*8-1) / (length-1);;
+
+        if (prev >= 0)
+        {
+            interp1(Lut_R  + prev, this - prev);
+            interp1(Lut_G1 + prev, this - prev);
+            interp1(Lut_G2 + prev, this - prev);
+            interp1(Lut_B  + prev, this - prev);
+        }
+    }
+    CHECK(fscanf(f, "}\n")                              == 0,   "}"      );
+    fclose(f);
+
+    if (0)
+    {
+        f = fopen("lut.m", "w");
+        fprintf(f, "lut = [\n");
+        for (int i = 0; i < 4096*8; i++)
+        {
+            fprintf(f, "%d %d %d %d\n", Lut_R[i], Lut_G1[i], Lut_G2[i], Lut_B[i]);
+        }
+        fprintf(f, "];");
+        fclose(f);
+    }
+}
+
+static uint64_t hash_file(char * filename)
+{
+    FILE* f = fopen(filename, "rb");
+    CHECK(f, "could not open %s", filename);
+
+    /* FNV-1a */
+    uint64_t hash = 0xCBF29CE484222325ull;
+    int c;
+    while ((c = fgetc(f)) != EOF)
+    {
+        hash = (hash ^ c) * 0x100000001B3ull;
+    }
+
+    fclose(f);
+    return hash;
+}
+
+static void free_lut()
+{
+    if (compiled_lut_mapped == 1)
+    {
+        munmap(compiled_lut, sizeof(*compiled_lut));
+    }
+    else if (!compiled_lut_mapped)
+    {
+        free(compiled_lut);
+    }
+    compiled_lut = 0;
+    compiled_lut_mapped = 0;
+}
+
+/* map the compiled LUT cache, if it's valid for this LUT file */
+static int map_lut_cache(char * cache_filename, int gain, uint64_t hash)
+{
+    int fd = open(cache_filename, O_RDONLY);
+    if (fd < 0) return 0;
+
+    struct stat st;
+    struct compiled_lut * lut = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size == sizeof(*lut))
+    {
+        lut = mmap(0, sizeof(*lut), PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (lut == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    if (memcmp(lut->magic, LUT_MAGIC, sizeof(lut->magic)) || lut->gain != gain ||
+        lut->size != LUT_SIZE || lut->hash != hash)
+    {
+        munmap(lut, sizeof(*lut));
+        return 0;
+    }
+
+    compiled_lut = lut;
+    compiled_lut_mapped = 1;
+    return 1;
+}
+
+/* load a LUT only once per batch, from the compiled cache if possible */
+static void load_lut(char * filename, int gain)
+{
+    static char loaded_filename[32];
+
+    if (!compiled_lut || strcmp(filename, loaded_filename) != 0)
+    {
+        free_lut();
+        snprintf(loaded_filename, sizeof(loaded_filename), "%s", filename);
+
+        char cache_filename[64];
+        snprintf(cache_filename, sizeof(cache_filename), "%s.bin", filename);
+        const struct calib_plane * plane = calib_store_find(filename);
+        uint64_t hash = 0;
+
+        if (plane && plane->type == CALIB_PLANE_LUT && plane->size == sizeof(*compiled_lut))
+        {
+            compiled_lut = (struct compiled_lut *) calib_store_data(plane);
+            compiled_lut_mapped = 2;
+        }
+        else if (hash = hash_file(filename), !map_lut_cache(cache_filename, gain, hash))
+        {
+            struct compiled_lut * lut = compiled_lut = calloc(1, sizeof(*lut));
+            CHECK(lut, "malloc");
+            read_lut(filename, &lut->components, &lut->length);
+
+            memcpy(lut->magic, LUT_MAGIC, sizeof(lut->magic));
+            lut->gain = gain;
+            lut->size = LUT_SIZE;
+            lut->hash = hash;
+            memcpy(lut->lut[0][0], Lut_G2, sizeof(Lut_G2));
+            memcpy(lut->lut[0][1], Lut_B,  sizeof(Lut_B));
+            memcpy(lut->lut[1][0], Lut_R,  sizeof(Lut_R));
+            memcpy(lut->lut[1][1], Lut_G1, sizeof(Lut_G1));
+
+            /* not fatal if we can't write it */
+            FILE* f = fopen(cache_filename, "wb");
+            if (f)
+            {
+                fwrite(lut, sizeof(*lut), 1, f);
+                fclose(f);
+            }
+        }
+    }
+
+    printf("%dx%d\n", compiled_lut->components, compiled_lut->length);
+}
+
+/* the LUTs already multiply the input values by 8 */
+static inline int16_t lut_lookup(const int16_t * lut, int16_t x)
+{
+    return MIN(lut[MAX(x, 0)], 32760);
+}
+
+/**
+ * PLR (multi-slope) exposure: at each knee point, pixels above the knee level
+ * are clipped to it, then they keep integrating for the remaining exposure time.
+ * The response is piecewise linear; its inverse is built as a regular compiled LUT,
+ * from the register values. To fit the 12-bit output, the linearized values
+ * are scaled down, so the saturation level maps to the white level.
+ * LUTs are kept for the last few register settings (see plr_lut_get).
+ */
+#define PLR_LUT_CACHE 4
+
+struct plr_key
+{
+    double expo;                /* ms */
+    double exp_kp[2];           /* see metadata_get_plr */
+    double level[2];
+    int black;
+    int white;
+};
+
+/* output of a PLR exposure for a pixel that would reach "linear" (DN above black) with a regular one */
+static double plr_response(struct plr_key * k, double linear)
+{
+    double range = k->white - k->black;
+    double s = linear * (k->expo - k->exp_kp[0]) / k->expo;
+    s = MIN(s, k->level[0] * range);
+    s += linear * (k->exp_kp[0] - k->exp_kp[1]) / k->expo;
+    s = MIN(s, k->level[1] * range);
+    s += linear * k->exp_kp[1] / k->expo;
+    return s;
+}
+
+/* the response is strictly increasing, so bisection is enough (only done once per setting) */
+static double plr_inverse(struct plr_key * k, double value, double hi)
+{
+    double lo = 0;
+    for (int i = 0; i < 50; i++)
+    {
+        double mid = (lo + hi) / 2;
+        if (plr_response(k, mid) < value) lo = mid; else hi = mid;
+    }
+    return (lo + hi) / 2;
+}
+
+/* linearization LUT for a PLR exposure, using the current black and white levels (12-bit) */
+/* returns 0 if the exposure has a single slope */
+static struct compiled_lut * plr_lut_get(uint16_t registers[128], struct raw_info * raw_info)
+{
+    static struct compiled_lut * cache[PLR_LUT_CACHE];
+    static struct plr_key keys[PLR_LUT_CACHE];
+    static double scales[PLR_LUT_CACHE];
+    static int next = 0;
+
+    struct plr_key key;
+    memset(&key, 0, sizeof(key));
+    key.expo = metadata_get_exposure(registers);
+    key.black = raw_info->black_level;
+    key.white = raw_info->white_level;
+    int num_slopes = metadata_get_plr(registers, key.exp_kp, key.level);
+
+    /* the last segment must have some exposure time, otherwise the response can't be inverted */
+    double t_last = (num_slopes >= 2) ? key.exp_kp[num_slopes - 2] : 0;
+    if (num_slopes < 2 || !(t_last > 0) || key.exp_kp[0] >= key.expo || key.white <= key.black)
+    {
+        return 0;
+    }
+
+    /* knee points out of order: the response is not monotonic, so it can't be inverted */
+    if (key.exp_kp[1] > key.exp_kp[0])
+    {
+        printf("PLR LUT     : Exp_kp2 > Exp_kp1, not linearized\n");
+        return 0;
+    }
+
+    int k = 0;
+    while (k < PLR_LUT_CACHE && !(cache[k] && memcmp(&keys[k], &key, sizeof(key)) == 0))
+    {
+        k++;
+    }
+
+    if (k == PLR_LUT_CACHE)
+    {
+        k = next;
+        next = (next + 1) % PLR_LUT_CACHE;
+
+        struct compiled_lut * lut = cache[k] = cache[k] ? cache[k] : calloc(1, sizeof(*lut));
+        CHECK(lut, "malloc");
+        keys[k] = key;
+
+        /* saturation level, in linear units (the last segment alone can't exceed the range) */
+        double range = key.white - key.black;
+        double hi = range * key.expo / t_last;
+        double scale = scales[k] = MAX(plr_inverse(&key, range, hi) / range, 1);
+
+        for (int i = 0; i < LUT_SIZE; i++)
+        {
+            /* identity below black level */
+            double v = i / 8.0 - key.black;
+            double out = (v > 0) ? key.black + plr_inverse(&key, MIN(v, range), hi) / scale : i / 8.0;
+            lut->lut[0][0][i] = MIN((int) round(out * 8), 32760);
+        }
+        memcpy(lut->lut[0][1], lut->lut[0][0], sizeof(lut->lut[0][0]));
+        memcpy(lut->lut[1][0], lut->lut[0][0], sizeof(lut->lut[0][0]));
+        memcpy(lut->lut[1][1], lut->lut[0][0], sizeof(lut->lut[0][0]));
+
+        memcpy(lut->magic, LUT_MAGIC, sizeof(lut->magic));
+        lut->gain = metadata_get_gain(registers);
+        lut->size = LUT_SIZE;
+        lut->components = 1;
+        lut->length = LUT_SIZE;
+    }
+
+    printf("PLR LUT     : %d slopes, +%.1f EV (highlights compressed %.3g:1)\n", num_slopes, log2(scales[k]), scales[k]);
+    return cache[k];
+}
+
+static void apply_lut(struct raw_info * raw_info, int16_t * raw16, struct compiled_lut * lut)
+{
+    int w = raw_info->width;
+    int h = raw_info->height;
+
+    PARALLEL_FOR
+    for (int y = 0; y < h; y++)
+    {
+        /* a and b can be either G2B (even lines) or RG1 (odd lines) */
+        const int16_t * restrict lut_a = lut->lut[y % 2][0];
+        const int16_t * restrict lut_b = lut->lut[y % 2][1];
+        int16_t * restrict row = raw16 + y*w;
+
+        for (int x = 0; x < w; x += 2)
+        {
+            row[x]   = lut_lookup(lut_a, row[x]);
+            row[x+1] = lut_lookup(lut_b, row[x+1]);
+        }
+    }
+}
+
+/* unpack one row of raw data (12, 10 or 8-bit) to 16-bit */
+/* this also promotes the data to 15-bit,
+ * so we can use int16_t for processing */
+static void unpack_row(struct raw_info * raw_info, const uint8_t * src, int16_t * restrict dst)
+{
+    int w = raw_info->width;
+
+    switch (raw_info->bits_per_pixel)
+    {
+        case 12:
+            for (int x = 0; x < w; x += 2)
+            {
+                const struct raw12_twopix * p = (const struct raw12_twopix *)(src + x * sizeof(struct raw12_twopix) / 2);
+                dst[x]   = ((p->a_hi << 4) | p->a_lo) << 3;
+                dst[x+1] = ((p->b_hi << 8) | p->b_lo) << 3;
+            }
+            break;
+
+        case 10:
+            for (int x = 0; x < w; x += 4)
+            {
+                const struct raw10_fourpix * p = (const struct raw10_fourpix *)(src + x * sizeof(struct raw10_fourpix) / 4);
+                dst[x]   = ((p->a_hi << 2) | p->a_lo) << 5;
+                dst[x+1] = ((p->b_hi << 4) | p->b_lo) << 5;
+                dst[x+2] = ((p->c_hi << 6) | p->c_lo) << 5;
+                dst[x+3] = ((p->d_hi << 8) | p->d_lo) << 5;
+            }
+            break;
+
+        case 8:
+            for (int x = 0; x < w; x++)
+            {
+                dst[x] = src[x] << 7;
+            }
+            break;
+    }
+}
+
+static void unpack_raw(struct raw_info * raw_info, int16_t * raw16)
+{
+    PARALLEL_FOR
+    for (int y = 0; y < raw_info->height; y++)
+    {
+        unpack_row(raw_info, (uint8_t *) raw_info->buffer + y * raw_info->pitch, raw16 + y * raw_info->width);
+    }
+}
+
+static void linear_fit(float* x, float* y, int n, float* a, float* b)
+{
+    /**
+     * plain least squares
+     * y = ax + b
+     * a = (mean(xy) - mean(x)mean(y)) / (mean(x^2) - mean(x)^2)
+     * b = mean(y) - a mean(x)
+     */
+
+    double mx = 0, my = 0, mxy = 0, mx2 = 0;
+    for (int i = 0; i < n; i++)
+    {
+        mx += x[i];
+        my += y[i];
         mxy += x[i] * y[i];
         mx2 += x[i] * x[i];
     }
@@ -983,7 +2473,28 @@ static void linear_fit(float* x, float* y, int n, float* a, float* b)
     *b = my - (*a) * mx;
 }
 
-static struct
+/* gain settings for calibration files (0 = unknown, 1...4), e.g. for --calib-pack */
+#define CALIB_GAINS 5
+
+/* calibration frames are accumulated separately for each gain setting found in the input files
+ * (any value, e.g. from --gain); each one gets a slot when first seen (see calib_select_gain) */
+#define CALIB_SLOTS 8
+
+/* image quality indicators of a dark frame (see check_darkframe_iq), in 12-bit DN */
+struct dark_iq
+{
+    float avg;
+    float pix_noise;
+    float row_noise;
+    float row_noise_odd;
+    float row_noise_evn;
+    float col_noise;
+    float col_noise_odd;
+    float col_noise_evn;
+};
+
+/* averaging accumulators (one set per gain) */
+struct avgframe_acc
 {
     int32_t * sum32;
     int16_t * min16;
@@ -991,39 +2502,63 @@ static struct
     int size;
     int count;
     int gain;
-    float exposures[1000];
-    float averages[1000];
-} A;
+    int allocated;              /* for exposures and averages (no limit on the number of frames) */
+    float * exposures;
+    float * averages;
+    char ** files;              /* for robust stacking: input files and their black offsets */
+    int * offsets;
+    int ** row_offsets;
+    struct dark_iq * iq;        /* for --calc-darkall */
+};
 
-static void calc_avgframe_addframe(struct raw_info * raw_info, int16_t * raw16, int meta_gain, float meta_expo)
+static struct avgframe_acc avgframe_acc[CALIB_SLOTS];
+static struct avgframe_acc * A = &avgframe_acc[0];
+
+/* filename, row_offsets: for robust stacking (row_offsets from subtract_black_columns, or null) */
+static void calc_avgframe_addframe(struct raw_info * raw_info, int16_t * raw16, int meta_gain, float meta_expo,
+                                   char * filename, int * row_offsets)
 {
     int n = raw_info->width * raw_info->height;
-    int new_frame_size = n * sizeof(A.sum32[0]);
+    int new_frame_size = n * sizeof(A->sum32[0]);
+
+    if (!A->size)
+    {
+        A->size = new_frame_size;
+        A->gain = meta_gain;
+    }
 
-    if (!A.sum32)
+    if (!A->sum32 && !robust_stack)
     {
         /* allocate memory on first call */
-        A.size = new_frame_size;
-        A.gain = meta_gain;
-        A.sum32 = malloc(A.size);
-        A.min16 = malloc(A.size/2);
-        A.max16 = malloc(A.size/2);
-        CHECK(A.sum32, "malloc");
-        CHECK(A.max16, "malloc");
-        CHECK(A.min16, "malloc");
+        A->sum32 = malloc(A->size);
+        A->min16 = malloc(A->size/2);
+        A->max16 = malloc(A->size/2);
+        CHECK(A->sum32, "malloc");
+        CHECK(A->max16, "malloc");
+        CHECK(A->min16, "malloc");
 
         for (int i = 0; i < n; i++)
         {
-            A.sum32[i] = 0;
-            A.min16[i] = INT16_MAX;
-            A.max16[i] = INT16_MIN;
+            A->sum32[i] = 0;
+            A->min16[i] = INT16_MAX;
+            A->max16[i] = INT16_MIN;
         }
     }
 
     /* sanity checking */
-    CHECK(A.size == new_frame_size, "all frames must have the same resolution.")
-    CHECK(A.gain == meta_gain, "all frames must have the same gain setting.")
-    CHECK(A.count < COUNT(A.exposures), "too many frames")
+    CHECK(A->size == new_frame_size, "all frames must have the same resolution.")
+
+    if (A->count == A->allocated)
+    {
+        A->allocated = MAX(A->allocated * 2, 256);
+        A->exposures = realloc(A->exposures, A->allocated * sizeof(A->exposures[0]));
+        A->averages  = realloc(A->averages,  A->allocated * sizeof(A->averages[0]));
+        A->files     = realloc(A->files,     A->allocated * sizeof(A->files[0]));
+        A->offsets   = realloc(A->offsets,   A->allocated * sizeof(A->offsets[0]));
+        A->row_offsets = realloc(A->row_offsets, A->allocated * sizeof(A->row_offsets[0]));
+        A->iq       = realloc(A->iq,       A->allocated * sizeof(A->iq[0]));
+        CHECK(A->exposures && A->averages && A->files && A->offsets && A->row_offsets && A->iq, "realloc");
+    }
 
     /* find offset */
     int offsets[4];
@@ -1034,36 +2569,161 @@ static void calc_avgframe_addframe(struct raw_info * raw_info, int16_t * raw16,
         calc_black_columns_offset(raw_info, raw16, offsets, &avg_offset);
     }
 
-    /* add current frame to accumulator */
-    for (int i = 0; i < n; i++)
-    {
-        int p = (int) raw16[i] - avg_offset;
-        A.sum32[i] += p;
-        A.max16[i] = MAX(A.max16[i], p);
-        A.min16[i] = MIN(A.min16[i], p);
-    }
-
-    /* compute average of current frame's active area */
+    /* add current frame to accumulator, and compute the average
+     * of its active area, in a single pass */
+    /* with robust stacking, pixels are read again from the input file at the end */
     int w = raw_info->width;
     int h = raw_info->height;
-    double avg = 0;
+    int64_t sum = 0;
+    PARALLEL_FOR_SUM(sum)
     for (int y = 0; y < h; y++)
     {
-        for (int x = 8; x < w-8; x++)
+        int16_t * restrict row = raw16 + y*w;
+        int row_sum = 0;
+
+        if (!robust_stack)
+        {
+            int32_t * restrict acc = A->sum32 + y*w;
+            int16_t * restrict min = A->min16 + y*w;
+            int16_t * restrict max = A->max16 + y*w;
+
+            for (int x = 0; x < w; x++)
+            {
+                int p = (int) row[x] - avg_offset;
+                acc[x] += p;
+                max[x] = MAX(max[x], p);
+                min[x] = MIN(min[x], p);
+            }
+        }
+
+        for (int x = black_cols.left; x < w - black_cols.right; x++)
         {
-            int p = (int) raw16[x + y*w] - avg_offset;
-            avg += p;
+            row_sum += row[x] - avg_offset;
         }
+
+        sum += row_sum;
     }
-    avg /= h * (w-16);
+    double avg = (double) sum / (h * (w - black_cols.left - black_cols.right));
 
     /* display values scaled back to 12-bit */
     printf("Average     : %.4f + %g\n", avg/8, avg_offset/8.0);
 
     /* record exposure and mean of each image */
-    A.exposures[A.count] = meta_expo;
-    A.averages [A.count] = avg/8;
-    A.count++;
+    A->exposures[A->count] = meta_expo;
+    A->averages [A->count] = avg/8;
+    A->files    [A->count] = filename;
+    A->offsets  [A->count] = avg_offset;
+    A->row_offsets[A->count] = row_offsets;
+    A->count++;
+}
+
+#define STACK_KAPPA 3.0
+
+/* robust average of the n values of one pixel (v is modified) */
+static int stack_pixel(int * v, int n)
+{
+    if (robust_stack == 1)
+    {
+        return median_int_wirth2(v, n);
+    }
+
+    /* kappa-sigma clipping: average, reject the values too far from it, repeat */
+    double mean = 0;
+    double lo = -INFINITY;
+    double hi = INFINITY;
+    int prev = -1;
+
+    for (int iter = 0; iter < 10; iter++)
+    {
+        int64_t s = 0, s2 = 0;
+        int m = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (v[i] >= lo && v[i] <= hi)
+            {
+                s  += v[i];
+                s2 += (int64_t) v[i] * v[i];
+                m++;
+            }
+        }
+
+        /* at least the value closest to the mean is always kept */
+        mean = (double) s / m;
+        if (m == prev) break;
+        prev = m;
+
+        double sd = sqrt(MAX((double) s2 / m - mean * mean, 0));
+        lo = mean - STACK_KAPPA * sd;
+        hi = mean + STACK_KAPPA * sd;
+    }
+
+    return (int) round(mean);
+}
+
+/* out-of-core stacking: for each band of rows, read that slice from all the
+ * input files (pread, one contiguous block per file), then stack each pixel;
+ * memory use is bounded by --stack-mem, regardless of the number of frames */
+static void calc_robust_stack(struct raw_info * raw_info, int offset)
+{
+    int w = raw_info->width;
+    int h = raw_info->height;
+    int n = A->count;
+
+    /* samples are stored per pixel, from all frames: [y][x][frame] */
+    int64_t row_size = (int64_t) w * n * sizeof(int);
+    int band = COERCE((int64_t) stack_memory * 1024 * 1024 / row_size, 1, h);
+    int * samples = malloc(band * row_size);
+    CHECK(samples, "malloc");
+
+    A->sum32 = malloc(w * h * sizeof(A->sum32[0]));
+    CHECK(A->sum32, "malloc");
+
+    printf("Stacking    : %s, %d rows at a time\n", robust_stack == 1 ? "median" : "kappa-sigma", band);
+
+    for (int y0 = 0; y0 < h; y0 += band)
+    {
+        int rows = MIN(band, h - y0);
+        int bytes = rows * raw_info->pitch;
+
+        PARALLEL_FOR
+        for (int f = 0; f < n; f++)
+        {
+            uint8_t * buf = malloc(bytes);
+            CHECK(buf, "malloc");
+
+            int fd = open(A->files[f], O_RDONLY);
+            CHECK(fd >= 0, "could not open %s", A->files[f]);
+            CHECK(pread(fd, buf, bytes, (off_t) y0 * raw_info->pitch) == bytes, "could not read %s", A->files[f]);
+            close(fd);
+
+            /* unpack, then subtract the same offsets as the regular code path
+             * (black columns, if any, then the average black offset) */
+            for (int y = 0; y < rows; y++)
+            {
+                int * ro = A->row_offsets[f] ? &A->row_offsets[f][2 * (y0 + y)] : (int[2]) {0, 0};
+                int16_t row[w];
+                unpack_row(raw_info, buf + y * raw_info->pitch, row);
+                for (int x = 0; x < w; x++)
+                {
+                    int16_t p = row[x] - (ro[0] + ro[1] * x / w);
+                    samples[(x + y*w) * n + f] = p - A->offsets[f];
+                }
+            }
+
+            free(buf);
+        }
+
+        PARALLEL_FOR
+        for (int y = 0; y < rows; y++)
+        {
+            for (int x = 0; x < w; x++)
+            {
+                A->sum32[x + (y0 + y)*w] = stack_pixel(&samples[(x + y*w) * n], n) + offset;
+            }
+        }
+    }
+
+    free(samples);
 }
 
 /* Output grayscale image to a 16-bit PGM file. */
@@ -1075,6 +2735,7 @@ static void save_pgm(char* filename, struct raw_info * raw_info, int32_t * raw32
     int h = raw_info->height;
     uint16_t* out = malloc(w * h * 2);
 
+    PARALLEL_FOR
     for (int y = 0; y < h; y ++)
     {
         for (int x = 0; x < w; x ++)
@@ -1097,48 +2758,61 @@ static void save_pgm(char* filename, struct raw_info * raw_info, int32_t * raw32
 #define CALC_GAIN_FRAME 1
 #define CALC_CLIP_FRAME 2
 
-static void calc_avgframe_finish(char* out_filename, struct raw_info * raw_info, int type)
+/* bad pixel thresholds, for dark frames (DN x 8) and gain frames (percent) */
+#define BADPIX_DARK_THR (32 * 8)
+#define BADPIX_GAIN_THR 25
+
+/* badpix_filename: if not null, update the bad pixel map from dark and gain frames */
+static void calc_avgframe_finish(char* out_filename, char* badpix_filename, struct raw_info * raw_info, int type)
 {
-    CHECK(A.sum32, "invalid call to calc_avgframe_finish")
+    CHECK(A->count, "invalid call to calc_avgframe_finish")
 
     int n = raw_info->width * raw_info->height;
 
     int offset = (type == CALC_DARK_FRAME) ? DARKFRAME_OFFSET :
                  (type == CALC_GAIN_FRAME) ? GAINFRAME_SCALING : 0 ;
 
-    for (int i = 0; i < n; i++)
+    if (robust_stack)
     {
-        if (A.count > 4)
-        {
-            /* cheap way to get rid of some outliers: subtract min/max values before averaging */
-            A.sum32[i] = (A.sum32[i] - A.min16[i] - A.max16[i] + A.count/2 - 1)
-                         / (A.count - 2) + offset;
-        }
-        else
+        calc_robust_stack(raw_info, offset);
+    }
+    else
+    {
+        PARALLEL_FOR
+        for (int i = 0; i < n; i++)
         {
-            /* not enough frames for min/max subtraction */
-            A.sum32[i] = (A.sum32[i] + A.count/2) / A.count + offset;
+            if (A->count > 4)
+            {
+                /* cheap way to get rid of some outliers: subtract min/max values before averaging */
+                A->sum32[i] = (A->sum32[i] - A->min16[i] - A->max16[i] + A->count/2 - 1)
+                             / (A->count - 2) + offset;
+            }
+            else
+            {
+                /* not enough frames for min/max subtraction */
+                A->sum32[i] = (A->sum32[i] + A->count/2) / A->count + offset;
+            }
         }
     }
 
     float expo_min = 1e10;
     float expo_max = 0;
-    for (int i = 0; i < A.count; i++)
+    for (int i = 0; i < A->count; i++)
     {
-        expo_min = MIN(expo_min, A.exposures[i]);
-        expo_max = MAX(expo_max, A.exposures[i]);
+        expo_min = MIN(expo_min, A->exposures[i]);
+        expo_max = MAX(expo_max, A->exposures[i]);
     }
 
     printf("\n");
     printf("-----------------------------\n");
     printf("\n");
-    printf("Averaged %d frames exposed from %.2f to %.2f ms.\n", A.count, expo_min, expo_max);
+    printf("Averaged %d frames exposed from %.2f to %.2f ms.\n", A->count, expo_min, expo_max);
 
-    if (A.count < 4)
+    if (A->count < 4)
     {
         printf("You really need to average more frames (at least 16).\n");
     }
-    else if (A.count < 16)
+    else if (A->count < 16)
     {
         printf("Please consider averaging more frames (at least 16).\n");
     }
@@ -1147,7 +2821,7 @@ static void calc_avgframe_finish(char* out_filename, struct raw_info * raw_info,
     if (type == CALC_DARK_FRAME)
     {
         float dark_current, dark_offset;
-        linear_fit(A.exposures, A.averages, A.count, &dark_current, &dark_offset);
+        linear_fit(A->exposures, A->averages, A->count, &dark_current, &dark_offset);
 
         if (!isfinite(dark_current))
         {
@@ -1162,26 +2836,60 @@ static void calc_avgframe_finish(char* out_filename, struct raw_info * raw_info,
 
         /* subtract average dark currents to get a "bias" frame */
         dark_offset = 0;
-        for (int i = 0; i < A.count; i++)
+        for (int i = 0; i < A->count; i++)
+        {
+            dark_offset += A->exposures[i] * dark_current;
+        }
+        dark_offset /= A->count;
+
+        int dark_off = (int)round(dark_offset);
+        printf("Dark offset : %.2f\n", dark_off/8.0);
+        PARALLEL_FOR
+        for (int i = 0; i < n; i++)
+        {
+            A->sum32[i] -= dark_off;
+        }
+    }
+
+    if (badpix_filename && (type == CALC_DARK_FRAME || type == CALC_GAIN_FRAME))
+    {
+        struct bad_pixel_list bad_pixels = {0};
+        int w, h;
+        if (badpix_read(badpix_filename, &bad_pixels, &w, &h) && w != raw_info->width)
         {
-            dark_offset += A.exposures[i] * dark_current;
+            badpix_free(&bad_pixels);
         }
-        dark_offset /= A.count;
 
-        int dark_off = (int)round(dark_offset);
-        printf("Dark offset : %.2f\n", dark_off/8.0);
-        for (int i = 0; i < n; i++)
+        if (type == CALC_DARK_FRAME)
+        {
+            badpix_find(&bad_pixels, A->sum32, raw_info->width, raw_info->height, BADPIX_DARK, BADPIX_DARK_THR);
+        }
+        else
         {
-            A.sum32[i] -= dark_off;
+            badpix_find(&bad_pixels, A->sum32, raw_info->width, raw_info->height, BADPIX_GAIN, BADPIX_GAIN_THR);
         }
+
+        printf("Saving %s...\n", badpix_filename);
+        badpix_save(badpix_filename, &bad_pixels, raw_info->width, raw_info->height);
+        badpix_free(&bad_pixels);
     }
 
-    save_pgm(out_filename, raw_info, A.sum32);
+    save_pgm(out_filename, raw_info, A->sum32);
 
-    free(A.sum32);
-    free(A.max16);
-    free(A.min16);
-    memset(&A, 0, sizeof(A));
+    free(A->sum32);
+    free(A->max16);
+    free(A->min16);
+    free(A->exposures);
+    free(A->averages);
+    for (int i = 0; i < A->count; i++)
+    {
+        free(A->row_offsets[i]);
+    }
+    free(A->files);
+    free(A->offsets);
+    free(A->row_offsets);
+    free(A->iq);
+    memset(A, 0, sizeof(*A));
 }
 
 static void calc_gainframe_do(struct raw_info * raw_info, int16_t * buf)
@@ -1199,10 +2907,11 @@ static void calc_gainframe_do(struct raw_info * raw_info, int16_t * buf)
 
     /* note: gain is scaled by 16384 */
     int w = raw_info->width;
+    PARALLEL_FOR
     for (int i = 0; i < n; i++)
     {
         int x = i % w;
-        buf[i] = (x < 8 || x >= w-8)
+        buf[i] = (x < black_cols.left || x >= w - black_cols.right)
                ? 16384                          /* do not touch black reference columns */
                : fixed[i] * 16384.0 / buf[i];   /* assume pattern noise in midtones is gain (PRNU) */
     }
@@ -1211,47 +2920,49 @@ static void calc_gainframe_do(struct raw_info * raw_info, int16_t * buf)
 }
 
 /* linear (least squares) fit between images (see linear_fit) */
-static struct
+/* the sums are exact (integers), with exposure times in fixed point */
+#define LINFIT_EXPO_SCALING 65536
+
+struct linfit_acc
 {
-    double * my;
-    double * mxy;
-    double mx;
-    double mx2;
+    int32_t * sy;               /* sum of pixel values (int32 is enough for 65535 frames) */
+    int64_t * sxy;              /* sum of exposure x pixel value */
+    int64_t sx;                 /* sum of exposures */
+    uint64_t sx2_lo;            /* sum of squared exposures, as a 128-bit value */
+    uint64_t sx2_hi;            /* (int64 overflows at 65535 frames above 180 ms) */
     int size;
     int count;
     int gain;
     float expo_min;
     float expo_max;
-} L;
+};
+
+static struct linfit_acc linfit_acc[CALIB_SLOTS];
+static struct linfit_acc * L = &linfit_acc[0];
 
 static void calc_linfitframes_addframe(struct raw_info * raw_info, int16_t * raw16, int meta_gain, float meta_expo)
 {
     int n = raw_info->width * raw_info->height;
-    int new_frame_size = n * sizeof(L.my[0]);
+    int new_frame_size = n;
 
-    if (!L.my)
+    if (!L->sy)
     {
         /* allocate memory on first call */
-        L.size = new_frame_size;
-        L.gain = meta_gain;
-        L.my = malloc(L.size);
-        L.mxy = malloc(L.size);
-        CHECK(L.my,  "malloc");
-        CHECK(L.mxy, "malloc");
-
-        for (int i = 0; i < n; i++)
-        {
-            L.my[i]  = 0;
-            L.mxy[i] = 0;
-        }
-
-        L.expo_min = 1e10;
-        L.expo_max = 0;
+        L->size = new_frame_size;
+        L->gain = meta_gain;
+        L->sy = calloc(n, sizeof(L->sy[0]));
+        L->sxy = calloc(n, sizeof(L->sxy[0]));
+        CHECK(L->sy,  "malloc");
+        CHECK(L->sxy, "malloc");
+
+        L->expo_min = 1e10;
+        L->expo_max = 0;
     }
 
     /* sanity checking */
-    CHECK(L.size == new_frame_size, "all frames must have the same resolution.")
-    CHECK(L.gain == meta_gain, "all frames must have the same gain setting.")
+    CHECK(L->size == new_frame_size, "all frames must have the same resolution.")
+    CHECK(L->count < 65535, "too many frames")
+    CHECK(meta_expo < 32768, "exposure too long for --calc-dcnuframe (%g ms)", meta_expo)
 
     /* find offset */
     int offsets[4];
@@ -1262,70 +2973,339 @@ static void calc_linfitframes_addframe(struct raw_info * raw_info, int16_t * raw
     }
 
     /* add current frame to accumulators */
-    L.mx += meta_expo;
-    L.mx2 += meta_expo * meta_expo;
-    for (int i = 0; i < n; i++)
+    /* x < 2^31, so sxy (x * 15-bit pixel values, 65535 frames) fits in int64 */
+    int64_t x = llround(meta_expo * LINFIT_EXPO_SCALING);
+    L->sx += x;
+    uint64_t x2 = (uint64_t) x * x;     /* x < 2^31, so this fits */
+    L->sx2_lo += x2;
+    L->sx2_hi += (L->sx2_lo < x2);      /* carry */
+
+    int w = raw_info->width;
+    int h = raw_info->height;
+    PARALLEL_FOR
+    for (int y = 0; y < h; y++)
     {
-        int p = (int) raw16[i] - avg_offset;
-        L.my[i]  += p;
-        L.mxy[i] += meta_expo * p;
+        int16_t * restrict row = raw16 + y*w;
+        int32_t * restrict sy = L->sy + y*w;
+        int64_t * restrict sxy = L->sxy + y*w;
+        for (int i = 0; i < w; i++)
+        {
+            int32_t p = row[i] - avg_offset;
+            sy[i]  += p;
+            sxy[i] += x * p;
+        }
     }
-    L.count++;
+    L->count++;
 
     /* keep track of min/max exposure, for printing at the end */
-    L.expo_max = MAX(L.expo_max, meta_expo);
-    L.expo_min = MIN(L.expo_min, meta_expo);
+    L->expo_max = MAX(L->expo_max, meta_expo);
+    L->expo_min = MIN(L->expo_min, meta_expo);
 }
 
 static void calc_linfitframes_finish(char* offset_filename, char* gain_filename, struct raw_info * raw_info)
 {
-    CHECK(L.my, "invalid call to calc_linfitframes_finish")
+    CHECK(L->sy, "invalid call to calc_linfitframes_finish")
 
     int n = raw_info->width * raw_info->height;
 
     printf("\n");
     printf("-----------------------------\n");
     printf("\n");
-    printf("Combined %d frames exposed from %.2f to %.2f ms.\n", L.count, L.expo_min, L.expo_max);
+    printf("Combined %d frames exposed from %.2f to %.2f ms.\n", L->count, L->expo_min, L->expo_max);
 
-    if (L.count < 16)
+    if (L->count < 16)
     {
         printf("You really need to use more frames (at least 64).\n");
     }
-    else if (L.count < 64)
+    else if (L->count < 64)
     {
         printf("Please consider using more frames (at least 64).\n");
     }
 
     /* finish the linear fitting */
-    L.mx /= L.count;
-    L.mx2 /= L.count;
-    for (int i = 0; i < n; i++)
-    {
-        L.my[i]  /= L.count;
-        L.mxy[i] /= L.count;
-    }
+    double mx  = (double) L->sx  / L->count / LINFIT_EXPO_SCALING;
+    double sx2 = ldexp(L->sx2_hi, 64) + L->sx2_lo;
+    double mx2 = sx2 / L->count / LINFIT_EXPO_SCALING / LINFIT_EXPO_SCALING;
 
     int32_t * a = malloc(n * sizeof(a[0]));
     int32_t * b = malloc(n * sizeof(a[0]));
 
+    PARALLEL_FOR
     for (int i = 0; i < n; i++)
     {
+        double my  = (double) L->sy[i] / L->count;
+        double mxy = (double) L->sxy[i] / L->count / LINFIT_EXPO_SCALING;
+
         /* note: when scaling, we keep in mind the raw data was multiplied by 8
          * when it was promoted to raw16, so we scale it back to 12-bit values */
-        double aa = (L.mxy[i] - L.mx * L.my[i]) / (L.mx2 - L.mx * L.mx);
+        double aa = (mxy - mx * my) / (mx2 - mx * mx);
         a[i] = (int)round(aa * DCNUFRAME_SCALING / 8 + DCNUFRAME_OFFSET);
-        b[i] = (int)round((L.my[i] - aa * L.mx) + DARKFRAME_OFFSET);
+        b[i] = (int)round((my - aa * mx) + DARKFRAME_OFFSET);
     }
 
     save_pgm(offset_filename, raw_info, b);
     save_pgm(gain_filename,   raw_info, a);
 
-    free(L.my);
-    free(L.mxy);
+    free(L->sy);
+    free(L->sxy);
     free(a);
     free(b);
-    memset(&L, 0, sizeof(L));
+    memset(L, 0, sizeof(*L));
+}
+
+/**
+ * Calibration checkpoints (--checkpoint)
+ *
+ * The accumulators (A, or L for --calc-dcnuframe) are saved together with
+ * the list of input files already added. A later run loads them, skips the
+ * files already included, adds the new ones and computes the calibration
+ * frames from all of them. Checkpoints are also saved periodically,
+ * so an interrupted run can be resumed.
+ *
+ * Native byte order (the file is not meant to be portable).
+ */
+#define CHECKPOINT_MAGIC "R2DCKP3"
+#define CHECKPOINT_INTERVAL 64
+
+struct checkpoint_header
+{
+    char magic[8];
+    int type;                   /* 0 = averaging (A), 1 = linear fit (L) */
+    int width;
+    int height;
+    int gain;
+    int count;
+    int names_size;             /* size of the file list (null-terminated strings) */
+};
+
+/* input files already added to the accumulators (one list per gain) */
+struct calib_frame_list
+{
+    char ** names;
+    int count;
+    int allocated;
+    int saved;                  /* count at the last checkpoint */
+    int loaded;                 /* checkpoint loaded (with the first input file for this gain) */
+};
+
+static struct calib_frame_list calib_frame_lists[CALIB_SLOTS];
+static struct calib_frame_list * calib_frames = &calib_frame_lists[0];
+
+/* gain setting for each accumulator slot, in the order they were first seen */
+static int calib_slot_gains[CALIB_SLOTS];
+static int calib_num_slots = 0;
+
+/* route the following frames to the accumulators for this gain */
+static void calib_select_gain(int gain)
+{
+    int slot = 0;
+    while (slot < calib_num_slots && calib_slot_gains[slot] != gain)
+    {
+        slot++;
+    }
+
+    if (slot == calib_num_slots)
+    {
+        CHECK(slot < CALIB_SLOTS, "too many different gain settings (max %d)", CALIB_SLOTS);
+        calib_slot_gains[calib_num_slots++] = gain;
+    }
+
+    A = &avgframe_acc[slot];
+    L = &linfit_acc[slot];
+    calib_frames = &calib_frame_lists[slot];
+}
+
+static void calib_frames_add(char * name)
+{
+    if (calib_frames->count == calib_frames->allocated)
+    {
+        calib_frames->allocated = MAX(calib_frames->allocated * 2, 256);
+        calib_frames->names = realloc(calib_frames->names, calib_frames->allocated * sizeof(calib_frames->names[0]));
+        CHECK(calib_frames->names, "realloc");
+    }
+
+    calib_frames->names[calib_frames->count] = strdup(name);
+    CHECK(calib_frames->names[calib_frames->count], "strdup");
+    calib_frames->count++;
+}
+
+static int calib_frames_find(char * name)
+{
+    for (int i = 0; i < calib_frames->count; i++)
+    {
+        if (strcmp(calib_frames->names[i], name) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void calib_frames_free()
+{
+    for (int g = 0; g < CALIB_SLOTS; g++)
+    {
+        struct calib_frame_list * list = &calib_frame_lists[g];
+        for (int i = 0; i < list->count; i++)
+        {
+            free(list->names[i]);
+        }
+        free(list->names);
+        memset(list, 0, sizeof(*list));
+    }
+}
+
+static void checkpoint_filename(char * out, int maxsize, int gain)
+{
+    snprintf(out, maxsize, "%s-x%d.ckpt",
+        calc_dcnuframe ? "dcnuframe" : calc_gainframe ? "gainframe" : calc_clipframe ? "clipframe" : "darkframe",
+        gain
+    );
+}
+
+static void checkpoint_write(void * data, size_t size, FILE* f)
+{
+    CHECK(fwrite(data, 1, size, f) == size, "could not write checkpoint");
+}
+
+static void checkpoint_read(void * data, size_t size, FILE* f)
+{
+    CHECK(fread(data, 1, size, f) == size, "checkpoint file truncated");
+}
+
+static void checkpoint_save(char * filename, struct raw_info * raw_info)
+{
+    int n = raw_info->width * raw_info->height;
+    int type = calc_dcnuframe;
+
+    CHECK(calib_frames->count == (type ? L->count : A->count), "checkpoint: frame list out of sync");
+
+    struct checkpoint_header hdr = {
+        .magic  = CHECKPOINT_MAGIC,
+        .type   = type,
+        .width  = raw_info->width,
+        .height = raw_info->height,
+        .gain   = type ? L->gain : A->gain,
+        .count  = calib_frames->count,
+    };
+
+    for (int i = 0; i < calib_frames->count; i++)
+    {
+        hdr.names_size += strlen(calib_frames->names[i]) + 1;
+    }
+
+    printf("Checkpoint  : %s (%d frames)\n", filename, calib_frames->count);
+
+    /* write to a temporary file first, so an interrupted save does not lose the old checkpoint */
+    char tmp_filename[256];
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", filename);
+    FILE* f = fopen(tmp_filename, "wb");
+    CHECK(f, "could not open %s", tmp_filename);
+
+    checkpoint_write(&hdr, sizeof(hdr), f);
+
+    if (type)
+    {
+        checkpoint_write(L->sy,  n * sizeof(L->sy[0]),  f);
+        checkpoint_write(L->sxy, n * sizeof(L->sxy[0]), f);
+        checkpoint_write(&L->sx, sizeof(L->sx), f);
+        checkpoint_write(&L->sx2_lo, sizeof(L->sx2_lo), f);
+        checkpoint_write(&L->sx2_hi, sizeof(L->sx2_hi), f);
+        checkpoint_write(&L->expo_min, sizeof(L->expo_min), f);
+        checkpoint_write(&L->expo_max, sizeof(L->expo_max), f);
+    }
+    else
+    {
+        checkpoint_write(A->sum32, n * sizeof(A->sum32[0]), f);
+        checkpoint_write(A->min16, n * sizeof(A->min16[0]), f);
+        checkpoint_write(A->max16, n * sizeof(A->max16[0]), f);
+        checkpoint_write(A->exposures, A->count * sizeof(A->exposures[0]), f);
+        checkpoint_write(A->averages,  A->count * sizeof(A->averages[0]),  f);
+    }
+
+    for (int i = 0; i < calib_frames->count; i++)
+    {
+        checkpoint_write(calib_frames->names[i], strlen(calib_frames->names[i]) + 1, f);
+    }
+
+    CHECK(fclose(f) == 0, "could not write checkpoint");
+    CHECK(rename(tmp_filename, filename) == 0, "could not rename %s", tmp_filename);
+
+    calib_frames->saved = calib_frames->count;
+}
+
+/* returns 0 if there is no checkpoint */
+static int checkpoint_load(char * filename, struct raw_info * raw_info, int gain)
+{
+    FILE* f = fopen(filename, "rb");
+    if (!f) return 0;
+
+    int n = raw_info->width * raw_info->height;
+    int type = calc_dcnuframe;
+    struct checkpoint_header hdr;
+    checkpoint_read(&hdr, sizeof(hdr), f);
+
+    CHECK(memcmp(hdr.magic, CHECKPOINT_MAGIC, sizeof(hdr.magic)) == 0 && hdr.type == type,
+          "%s: not a valid checkpoint", filename);
+    CHECK(hdr.width == raw_info->width && hdr.height == raw_info->height && hdr.gain == gain,
+          "%s: resolution or gain does not match the input files", filename);
+
+    if (type)
+    {
+        L->size  = n;
+        L->gain  = gain;
+        L->count = hdr.count;
+        L->sy  = malloc(n * sizeof(L->sy[0]));
+        L->sxy = malloc(n * sizeof(L->sxy[0]));
+        CHECK(L->sy && L->sxy, "malloc");
+        checkpoint_read(L->sy,  n * sizeof(L->sy[0]),  f);
+        checkpoint_read(L->sxy, n * sizeof(L->sxy[0]), f);
+        checkpoint_read(&L->sx, sizeof(L->sx), f);
+        checkpoint_read(&L->sx2_lo, sizeof(L->sx2_lo), f);
+        checkpoint_read(&L->sx2_hi, sizeof(L->sx2_hi), f);
+        checkpoint_read(&L->expo_min, sizeof(L->expo_min), f);
+        checkpoint_read(&L->expo_max, sizeof(L->expo_max), f);
+    }
+    else
+    {
+        int m = MAX(hdr.count, 1);
+        A->size  = n * sizeof(A->sum32[0]);
+        A->gain  = gain;
+        A->count = hdr.count;
+        A->allocated = m;
+        A->sum32 = malloc(n * sizeof(A->sum32[0]));
+        A->min16 = malloc(n * sizeof(A->min16[0]));
+        A->max16 = malloc(n * sizeof(A->max16[0]));
+        A->exposures   = malloc(m * sizeof(A->exposures[0]));
+        A->averages    = malloc(m * sizeof(A->averages[0]));
+        A->files       = calloc(m, sizeof(A->files[0]));
+        A->offsets     = calloc(m, sizeof(A->offsets[0]));
+        A->row_offsets = calloc(m, sizeof(A->row_offsets[0]));
+        A->iq          = calloc(m, sizeof(A->iq[0]));
+        CHECK(A->sum32 && A->min16 && A->max16 && A->exposures && A->averages &&
+              A->files && A->offsets && A->row_offsets && A->iq, "malloc");
+        checkpoint_read(A->sum32, n * sizeof(A->sum32[0]), f);
+        checkpoint_read(A->min16, n * sizeof(A->min16[0]), f);
+        checkpoint_read(A->max16, n * sizeof(A->max16[0]), f);
+        checkpoint_read(A->exposures, A->count * sizeof(A->exposures[0]), f);
+        checkpoint_read(A->averages,  A->count * sizeof(A->averages[0]),  f);
+    }
+
+    char * names = malloc(MAX(hdr.names_size, 1));
+    CHECK(names, "malloc");
+    checkpoint_read(names, hdr.names_size, f);
+    for (char * p = names; p < names + hdr.names_size; p += strlen(p) + 1)
+    {
+        calib_frames_add(p);
+    }
+    free(names);
+    fclose(f);
+
+    CHECK(calib_frames->count == hdr.count, "%s: invalid file list", filename);
+    calib_frames->saved = calib_frames->count;
+
+    printf("Checkpoint  : %s (%d frames)\n", filename, hdr.count);
+    return 1;
 }
 
 /* like octave mean(x) */
@@ -1390,7 +3370,8 @@ static void display_rc_noise(
     }
 }
 
-static void check_darkframe_iq(struct raw_info * raw_info, int16_t * raw16)
+/* out: if not null, receives the quality indicators */
+static void check_darkframe_iq(struct raw_info * raw_info, int16_t * raw16, struct dark_iq * out)
 {
     int w = raw_info->width;
     int h = raw_info->height;
@@ -1455,6 +3436,20 @@ static void check_darkframe_iq(struct raw_info * raw_info, int16_t * raw16)
     display_rc_noise(row_noise, row_noise_odd, row_noise_evn, pix_noise, "Row", "col");
     display_rc_noise(col_noise, col_noise_odd, col_noise_evn, pix_noise, "Col", "row");
 
+    if (out)
+    {
+        *out = (struct dark_iq) {
+            .avg            = avg,
+            .pix_noise      = pix_noise,
+            .row_noise      = row_noise,
+            .row_noise_odd  = row_noise_odd,
+            .row_noise_evn  = row_noise_evn,
+            .col_noise      = col_noise,
+            .col_noise_odd  = col_noise_odd,
+            .col_noise_evn  = col_noise_evn,
+        };
+    }
+
     free(center_crop);
     free(row_avg);
     free(row_avg_odd);
@@ -1464,20 +3459,119 @@ static void check_darkframe_iq(struct raw_info * raw_info, int16_t * raw16)
     free(col_avg_evn);
 }
 
-static void check_levels(struct raw_info * raw_info, int16_t * raw16)
+static void json_string(FILE* f, char * str)
+{
+    fputc('"', f);
+    for (char * c = str; *c; c++)
+    {
+        if (*c == '"' || *c == '\\') fputc('\\', f);
+        if ((unsigned char) *c >= 0x20) fputc(*c, f);
+    }
+    fputc('"', f);
+}
+
+static void json_iq(FILE* f, struct dark_iq * iq)
+{
+    fprintf(f, "\"average\": %.4f, \"pixel_noise\": %.4f, "
+               "\"row_noise\": %.4f, \"row_noise_odd\": %.4f, \"row_noise_even\": %.4f, "
+               "\"col_noise\": %.4f, \"col_noise_odd\": %.4f, \"col_noise_even\": %.4f",
+        iq->avg, iq->pix_noise,
+        iq->row_noise, iq->row_noise_odd, iq->row_noise_evn,
+        iq->col_noise, iq->col_noise_odd, iq->col_noise_evn
+    );
+}
+
+static int compare_floats(const void * a, const void * b)
+{
+    float fa = *(const float *) a;
+    float fb = *(const float *) b;
+    return (fa > fb) - (fa < fb);
+}
+
+/* note: reorders the values */
+static float median_float(float * values, int n)
+{
+    if (!n) return 0;
+    qsort(values, n, sizeof(values[0]), compare_floats);
+    return (n % 2) ? values[n/2] : (values[n/2 - 1] + values[n/2]) / 2;
+}
+
+/* quality report for --calc-darkall: per-frame indicators (from A), and their median */
+/* the frames are measured as they are read, i.e. before dark frame correction (the fit is not known yet) */
+static void save_dark_report(char * filename, int gain)
+{
+    printf("Writing %s...\n", filename);
+
+    int n = A->count;
+    FILE* f = fopen(filename, "w");
+    CHECK(f, "could not open %s", filename);
+
+    /* median of each indicator (robust to a few bad frames) */
+    float * values = malloc(MAX(n, 1) * sizeof(values[0]));
+    CHECK(values, "malloc");
+
+    #define MEDIAN_IQ(field) ({                 \
+        for (int i = 0; i < n; i++)             \
+            values[i] = A->iq[i].field;         \
+        median_float(values, n);                \
+    })
+
+    struct dark_iq med = {
+        .avg            = MEDIAN_IQ(avg),
+        .pix_noise      = MEDIAN_IQ(pix_noise),
+        .row_noise      = MEDIAN_IQ(row_noise),
+        .row_noise_odd  = MEDIAN_IQ(row_noise_odd),
+        .row_noise_evn  = MEDIAN_IQ(row_noise_evn),
+        .col_noise      = MEDIAN_IQ(col_noise),
+        .col_noise_odd  = MEDIAN_IQ(col_noise_odd),
+        .col_noise_evn  = MEDIAN_IQ(col_noise_evn),
+    };
+
+    #undef MEDIAN_IQ
+    free(values);
+
+    float dark_current, dark_offset;
+    linear_fit(A->exposures, A->averages, n, &dark_current, &dark_offset);
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"gain\": %d,\n", gain);
+    fprintf(f, "  \"frames\": %d,\n", n);
+    fprintf(f, "  \"dark_frame_corrected\": false,\n");
+    fprintf(f, "  \"dark_current\": %.6f,\n", isfinite(dark_current) ? dark_current : 0);
+    fprintf(f, "  \"median\": { ");
+    json_iq(f, &med);
+    fprintf(f, " },\n");
+    fprintf(f, "  \"files\": [\n");
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(f, "    { \"file\": ");
+        json_string(f, A->files[i]);
+        fprintf(f, ", \"exposure\": %.4f, ", A->exposures[i]);
+        json_iq(f, &A->iq[i]);
+        fprintf(f, " }%s\n", i < n - 1 ? "," : "");
+    }
+    fprintf(f, "  ]\n");
+    fprintf(f, "}\n");
+
+    fclose(f);
+}
+
+/* lut: if not null, check the levels after applying it (see pack_raw) */
+static void check_levels(struct raw_info * raw_info, int16_t * raw16, struct compiled_lut * lut)
 {
     int w = raw_info->width;
     int h = raw_info->height;
     int below = 0;
     int above = 0;
 
+    PARALLEL_FOR_SUM(below, above)
     for (int y = 0; y < h; y++)
     {
         /* skip black columns, just in case */
-        for (int x = 8; x < w - 8; x++)
+        for (int x = black_cols.left; x < w - black_cols.right; x++)
         {
             /* note: raw16 data is multiplied by 8 (12 bits promoted to 15 bits + sign) */
-            int p = raw16[x + y*w] >> 3;
+            int p = (lut ? lut_lookup(lut->lut[y % 2][x % 2], raw16[x + y*w]) : raw16[x + y*w]) >> 3;
             below += (p <  raw_info->black_level);   /* crushed blacks */
             above += (p >= raw_info->white_level);   /* clipped highlights */
         }
@@ -1501,44 +3595,227 @@ static void check_levels(struct raw_info * raw_info, int16_t * raw16)
     printf("Above white : %.2f%%%s\n", above_percentage, above_advice);
 }
 
-/* pack raw data from 16-bit to 12-bit */
+/* one pseudo-random bit for each pixel, from its position and a per-frame seed */
+/* unlike rand(), the result does not depend on the order pixels are processed */
+static inline unsigned dither_bit(uint32_t i, uint32_t seed)
+{
+    uint32_t h = (i ^ seed) * 0x9E3779B1u;
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    return h & 1;
+}
+
+/* pack one row of 16-bit data to 12, 10 or 8-bit (see pack_raw) */
+static void pack_row(struct raw_info * raw_info, const int16_t * row, uint8_t * dst, int y, uint32_t seed)
+{
+    unsigned w = raw_info->width;
+
+    switch (raw_info->bits_per_pixel)
+    {
+        case 12:
+            for (int x = 0; x < w; x += 2)
+            {
+                struct raw12_twopix * p = (struct raw12_twopix *)(dst + x * sizeof(struct raw12_twopix) / 2);
+                unsigned a = ((MAX(row[x],  0) >> 2) + dither_bit(x + y*w,     seed)) >> 1;
+                unsigned b = ((MAX(row[x+1],0) >> 2) + dither_bit(x + 1 + y*w, seed)) >> 1;
+                p->a_lo = a; p->a_hi = a >> 4;
+                p->b_lo = b; p->b_hi = b >> 8;
+            }
+            break;
+
+        case 10:
+            for (int x = 0; x < w; x += 4)
+            {
+                struct raw10_fourpix * p = (struct raw10_fourpix *)(dst + x * sizeof(struct raw10_fourpix) / 4);
+                unsigned v[4];
+                for (int i = 0; i < 4; i++)
+                {
+                    v[i] = MIN(((MAX(row[x+i], 0) >> 4) + dither_bit(x + i + y*w, seed)) >> 1, 1023);
+                }
+                p->a_lo = v[0]; p->a_hi = v[0] >> 2;
+                p->b_lo = v[1]; p->b_hi = v[1] >> 4;
+                p->c_lo = v[2]; p->c_hi = v[2] >> 6;
+                p->d_lo = v[3]; p->d_hi = v[3] >> 8;
+            }
+            break;
+
+        case 8:
+            for (int x = 0; x < w; x++)
+            {
+                dst[x] = MIN(((MAX(row[x], 0) >> 6) + dither_bit(x + y*w, seed)) >> 1, 255);
+            }
+            break;
+    }
+}
+
+/* pack raw data from 16-bit to 12-bit (or 10/8-bit, as in the input file) */
 /* this also adds some anti-posterization noise,
  * which acts somewhat like introducing one extra bit of detail */
-static void pack12(struct raw_info * raw_info, int16_t * buf)
+/* lut: if not null, it's applied while packing (same as apply_lut, without an extra pass) */
+static void pack_raw(struct raw_info * raw_info, int16_t * buf, struct compiled_lut * lut)
 {
+    /* different noise pattern on each frame */
+    static uint32_t frame_count = 0;
+    uint32_t seed = (frame_count++) * 0x27D4EB2Du;
+
+    PARALLEL_FOR
     for (int y = 0; y < raw_info->height; y++)
     {
-        for (int x = 0; x < raw_info->width; x += 2)
+        unsigned w = raw_info->width;
+        int16_t * row = buf + y*w;
+        int16_t out[w];
+
+        if (lut)
         {
-            struct raw12_twopix * p = (struct raw12_twopix *)(raw_info->buffer + y * raw_info->pitch + x * sizeof(struct raw12_twopix) / 2);
-            unsigned w = raw_info->width;
-            unsigned a = ((MAX(buf[x + y*w],    0) >> 2) + rand()%2) >> 1;
-            unsigned b = ((MAX(buf[x + 1 + y*w],0) >> 2) + rand()%2) >> 1;
-            p->a_lo = a; p->a_hi = a >> 4;
-            p->b_lo = b; p->b_hi = b >> 8;
+            /* a and b can be either G2B (even lines) or RG1 (odd lines) */
+            const int16_t * restrict lut_a = lut->lut[y % 2][0];
+            const int16_t * restrict lut_b = lut->lut[y % 2][1];
+            for (int x = 0; x < w; x += 2)
+            {
+                out[x]   = lut_lookup(lut_a, row[x]);
+                out[x+1] = lut_lookup(lut_b, row[x+1]);
+            }
+            row = out;
         }
+
+        pack_row(raw_info, row, (uint8_t *) raw_info->buffer + y * raw_info->pitch, y, seed);
     }
 }
 
-/* todo: move this into FPGA */
-void reverse_lines_order(char* buf, int count, int width)
+/**
+ * Interleaved dual exposure (Exp_dual): column pairs alternate between Exp_time and Exp_time2
+ * (columns 0-1: Exp_time, 2-3: Exp_time2, 4-5: Exp_time and so on), so the same color channel
+ * from the other exposure is 2 pixels to the left and to the right.
+ *
+ * The short exposure is multiplied by the exposure ratio; each pixel is then a blend
+ * of the long exposure (less noise) and the short one (not clipped), weighted by how close
+ * the long exposure is to clipping. The missing exposure is interpolated from the two neighbours.
+ *
+ * Output is 16-bit (native byte order), written over raw16; each row only reads its own pixels.
+ * Black level: black * 16; white level: 65535 (long exposure clipping point, times the ratio).
+ */
+static void merge_dual_exposure(struct raw_info * raw_info, int16_t * raw16, float ratio, int long_pair)
 {
-    /* line width, in bytes */
-    int pitch = width * 12 / 8;
-    void* aux = malloc(pitch);
-    CHECK(aux, "malloc");
+    int w = raw_info->width;
+    int black = raw_info->black_level * 8;
+    float range = (raw_info->white_level - raw_info->black_level) * 8;
+
+    /* long exposure only, up to 80% of its range; short exposure only, above 95% */
+    float lo = range * 0.80f;
+    float hi = range * 0.95f;
+
+    float black16 = raw_info->black_level * 16;
+    float scale = (65535 - black16) / (range * ratio);
+
+    /* short exposure is brought to the scale of the long one */
+    float k[2];
+    k[long_pair] = 1;
+    k[!long_pair] = ratio;
+
+    PARALLEL_FOR
+    for (int y = 0; y < raw_info->height; y++)
+    {
+        int16_t * row = raw16 + y*w;
+        uint16_t * out = (uint16_t *) row;
+        float in[w];
+
+        for (int x = 0; x < w; x++)
+        {
+            in[x] = (row[x] - black) * k[(x >> 1) & 1];
+        }
+
+        for (int x = 0; x < w; x++)
+        {
+            /* at the image edges, the only neighbour is used twice */
+            float left  = in[x >= 2 ? x - 2 : x + 2];
+            float right = in[x + 2 < w ? x + 2 : x - 2];
+            float own   = in[x];
+            float other = (left + right) * 0.5f;
+
+            int is_long = ((x >> 1) & 1) == long_pair;
+            float L     = is_long ? own : other;
+            float S     = is_long ? other : own;
+            float L_ref = is_long ? own : MAX(left, right);
+
+            float wl = COERCE((hi - L_ref) / (hi - lo), 0.0f, 1.0f);
+            float v = S + wl * (L - S);
+            out[x] = COERCE(black16 + v * scale + 0.5f, 0.0f, 65535.0f);
+        }
+    }
+}
+
+/* 16-bit output: clip negative values, in place, so raw16 can be saved as it is (12-bit x 8) */
+/* lut: if not null, it's applied in the same pass (see pack_raw) */
+static void finish_raw16(struct raw_info * raw_info, int16_t * raw16, struct compiled_lut * lut)
+{
+    int w = raw_info->width;
+
+    PARALLEL_FOR
+    for (int y = 0; y < raw_info->height; y++)
+    {
+        int16_t * restrict row = raw16 + y*w;
+
+        if (lut)
+        {
+            const int16_t * restrict lut_a = lut->lut[y % 2][0];
+            const int16_t * restrict lut_b = lut->lut[y % 2][1];
+            for (int x = 0; x < w; x += 2)
+            {
+                row[x]   = lut_lookup(lut_a, row[x]);
+                row[x+1] = lut_lookup(lut_b, row[x+1]);
+            }
+        }
+
+        for (int x = 0; x < w; x++)
+        {
+            row[x] = MAX(row[x], 0);
+        }
+    }
+}
+
+/* 16-bit output: raw16 replaces the packed raw buffer (no copy)
+ * samples are in native byte order (little endian, same as the DNG header) */
+static void raw_info_use_raw16(struct raw_info * raw_info, int16_t * raw16)
+{
+    free(raw_info->buffer);
+    raw_info->buffer = raw16;
+    raw_info->bits_per_pixel = 16;
+    raw_info->pitch = raw_info->width * 2;
+    raw_info->frame_size = raw_info->height * raw_info->pitch;
+}
+
+/* apply a constant offset (12-bit units) to each raw pixel */
+static void raw_data_offset(struct raw_info * raw_info, int offset)
+{
+    PARALLEL_FOR
+    for (int y = 0; y < raw_info->height; y++)
+    {
+        uint8_t * data = (uint8_t *) raw_info->buffer + y * raw_info->pitch;
+        int16_t row[raw_info->width];
+        unpack_row(raw_info, data, row);
+        for (int x = 0; x < raw_info->width; x++)
+        {
+            row[x] = MIN(row[x] + offset * 8, 4095 * 8);
+        }
+        pack_row(raw_info, row, data, y, 0);
+    }
+}
 
+/* todo: move this into FPGA */
+/* pitch: line width, in bytes */
+void reverse_lines_order(char* buf, int count, int pitch)
+{
     /* swap odd and even lines */
-    int i;
     int height = count / pitch;
-    for (i = 0; i < height; i += 2)
+    PARALLEL_FOR
+    for (int i = 0; i < height; i += 2)
     {
+        char aux[pitch];
         memcpy(aux, buf + i * pitch, pitch);
         memcpy(buf + i * pitch, buf + (i+1) * pitch, pitch);
         memcpy(buf + (i+1) * pitch, aux, pitch);
     }
-
-    free(aux);
 }
 
 static void hdmi_reorder(struct raw_info * raw_info)
@@ -1569,6 +3846,7 @@ static void hdmi_reorder(struct raw_info * raw_info)
      */
 
     /* handle one Bayer block at a time */
+    PARALLEL_FOR
     for (int y = 0; y < raw_info->height-2; y += 2)
     {
         for (int x = 0; x < raw_info->width; x += 2)
@@ -1608,6 +3886,60 @@ static int endswith(char* str, char* suffix)
     return 0;
 }
 
+/* bit depth of a raw file (12, 10 or 8): from the metadata block (Bit_mode),
+ * if it matches the file size; otherwise, from the file size alone
+ * (only if the image height is known); default 12 */
+static int detect_bit_depth(FILE* fi, int width, int height)
+{
+    fseek(fi, 0, SEEK_END);
+    int64_t size = ftell(fi);
+    int bits = 0;
+
+    uint16_t registers[128];
+    if (size > 256 && fseek(fi, -256, SEEK_END) == 0 && fread(registers, 1, 256, fi) == 256)
+    {
+        int b = metadata_get_bit_depth(registers);
+        int64_t data = size - 256;
+        int64_t row = width * b / 8;
+        if (b && data % row == 0 && (!height || data == height * row))
+        {
+            bits = b;
+        }
+    }
+
+    for (int b = 12; b >= 8 && !bits && height; b -= 2)
+    {
+        /* raw data, with or without a metadata block */
+        int64_t data = (int64_t) height * width * b / 8;
+        if (size == data || size == data + 256)
+        {
+            bits = b;
+        }
+    }
+
+    fseek(fi, 0, SEEK_SET);
+    return bits ? bits : 12;
+}
+
+/* ask the OS to start reading the next input file in the background,
+ * while we are processing the current one */
+static void prefetch_next_input(int argc, char** argv, int k)
+{
+    for (k = k + 1; k < argc; k++)
+    {
+        if (argv[k][0] != '-' && (endswith(argv[k], ".raw12") || endswith(argv[k], ".pgm")))
+        {
+            int fd = open(argv[k], O_RDONLY);
+            if (fd >= 0)
+            {
+                posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+                close(fd);
+            }
+            return;
+        }
+    }
+}
+
 /* 16-bit pgm, Bayer GBRG, for testing purposes (e.g. saved from octave) */
 static int read_pgm_stream(FILE* fp, struct raw_info * raw_info, int16_t ** praw16)
 {
@@ -1655,6 +3987,7 @@ static int read_pgm_stream(FILE* fp, struct raw_info * raw_info, int16_t ** praw
     reverse_bytes_order((void*)raw16, size);
 
     /* scale data by 8 */
+    PARALLEL_FOR
     for (int i = 0; i < width * height; i++)
     {
         raw16[i] *= 8;
@@ -1694,6 +4027,7 @@ static void moving_average_addframe(struct raw_info * raw_info, int16_t * raw16)
         M.avg = malloc(frame_size);
         CHECK(M.avg, "malloc");
 
+        PARALLEL_FOR
         for (int i = 0; i < n; i++)
         {
             M.avg[i] = raw16[i] * 1024;
@@ -1701,6 +4035,7 @@ static void moving_average_addframe(struct raw_info * raw_info, int16_t * raw16)
     }
 
     /* add current frame to accumulator */
+    PARALLEL_FOR
     for (int i = 0; i < n; i++)
     {
         int pix = raw16[i] * 1024;
@@ -1726,6 +4061,7 @@ static void fix_pattern_noise_temporally(struct raw_info * raw_info, int16_t * r
     int n = raw_info->width * raw_info->height;
     int16_t* avg = malloc(n * sizeof(avg[0]));
 
+    PARALLEL_FOR
     for (int i = 0; i < n; i++)
     {
         avg[i] = (M.avg[i] + 512) / 1024;
@@ -1736,6 +4072,174 @@ static void fix_pattern_noise_temporally(struct raw_info * raw_info, int16_t * r
     free(avg);
 }
 
+/* add a plane to a calibration store being packed; data is written later, at plane->offset */
+static void calib_pack_add(struct calib_header * hdr, const void ** data, char * filename,
+                           int type, int width, int height, int count, const void * plane_data, size_t size)
+{
+    CHECK(hdr->num_planes < CALIB_MAX_PLANES, "too many planes");
+
+    struct calib_plane * prev = hdr->num_planes ? &hdr->planes[hdr->num_planes - 1] : 0;
+    uint64_t end = prev ? prev->offset + prev->size : sizeof(*hdr);
+
+    struct calib_plane * plane = &hdr->planes[hdr->num_planes];
+    snprintf(plane->name, sizeof(plane->name), "%s", filename);
+    plane->type     = type;
+    plane->width    = width;
+    plane->height   = height;
+    plane->count    = count;
+    plane->offset   = (end + CALIB_PAGE - 1) / CALIB_PAGE * CALIB_PAGE;
+    plane->size     = size;
+    plane->checksum = hash_buffer(plane_data, size);
+    plane->mtime    = file_mtime(filename);
+
+    data[hdr->num_planes++] = plane_data;
+    printf("Packing     : %s\n", filename);
+}
+
+/* --calib-pack: all reference files for this gain into calib-xN.bin */
+static void calib_pack_gain(int gain)
+{
+    static char * frame_formats[] = { "darkframe-x%d.pgm", "dcnuframe-x%d.pgm", "gainframe-x%d.pgm", "clipframe-x%d.pgm" };
+
+    struct calib_header hdr = {
+        .magic              = CALIB_MAGIC,
+        .byte_order         = CALIB_BYTE_ORDER,
+        .header_size        = sizeof(hdr),
+        .gain               = gain,
+        .darkframe_offset   = DARKFRAME_OFFSET,
+        .dcnuframe_offset   = DCNUFRAME_OFFSET,
+        .dcnuframe_scaling  = DCNUFRAME_SCALING,
+        .gainframe_scaling  = GAINFRAME_SCALING,
+    };
+    const void * data[CALIB_MAX_PLANES];
+    char filename[32];
+
+    for (int i = 0; i < COUNT(frame_formats); i++)
+    {
+        snprintf(filename, sizeof(filename), frame_formats[i], gain);
+        if (!file_exists(filename))
+        {
+            continue;
+        }
+
+        int w, h;
+        FILE* fp = open_pgm(filename, &w, &h);
+        CHECK(!hdr.width || (w == hdr.width && h == hdr.height), "%s: reference frames must have the same size", filename);
+        hdr.width = w;
+        hdr.height = h;
+
+        size_t size = (size_t) w * h * sizeof(uint16_t);
+        uint8_t * buf = malloc(size);
+        CHECK(buf, "malloc");
+        CHECK(fread(buf, 1, size, fp) == size, "fread");
+        fclose(fp);
+
+        reverse_bytes_order(buf, size);
+        calib_pack_add(&hdr, data, filename, CALIB_PLANE_FRAME, w, h, 0, buf, size);
+    }
+
+    char dcnu_filename[32];
+    snprintf(dcnu_filename, sizeof(dcnu_filename), "dcnuframe-x%d.pgm", gain);
+    snprintf(filename, sizeof(filename), "hotpixels-x%d.txt", gain);
+    if (hdr.width && file_exists(filename) && !file_is_older(filename, dcnu_filename))
+    {
+        struct raw_info ri = { .width = hdr.width, .height = hdr.height };
+        if (hot_pixels_read(filename, &ri, 0))
+        {
+            size_t size = hot_pixels.count * sizeof(hot_pixels.pixels[0]);
+            void * buf = malloc(MAX(size, 1));
+            CHECK(buf, "malloc");
+            memcpy(buf, hot_pixels.pixels, size);
+            calib_pack_add(&hdr, data, filename, CALIB_PLANE_HOTPIX, hdr.width, hdr.height, hot_pixels.count, buf, size);
+        }
+        hot_pixels.count = 0;
+    }
+
+    snprintf(filename, sizeof(filename), "lut-x%d.spi1d", gain);
+    if (file_exists(filename))
+    {
+        printf("LUT file    : %s ", filename);
+        load_lut(filename, gain);
+        void * buf = malloc(sizeof(*compiled_lut));
+        CHECK(buf, "malloc");
+        memcpy(buf, compiled_lut, sizeof(*compiled_lut));
+        free_lut();
+        calib_pack_add(&hdr, data, filename, CALIB_PLANE_LUT, 0, 0, 0, buf, sizeof(*compiled_lut));
+    }
+
+    if (!hdr.num_planes)
+    {
+        return;
+    }
+
+    hdr.checksum = hash_buffer(&hdr, offsetof(struct calib_header, checksum));
+
+    char out_filename[32];
+    char tmp_filename[40];
+    snprintf(out_filename, sizeof(out_filename), "calib-x%d.bin", gain);
+    snprintf(tmp_filename, sizeof(tmp_filename), "%s.tmp", out_filename);
+    printf("Writing %s...\n", out_filename);
+
+    FILE* f = fopen(tmp_filename, "wb");
+    CHECK(f, "could not open %s", tmp_filename);
+    CHECK(fwrite(&hdr, sizeof(hdr), 1, f) == 1, "fwrite");
+
+    /* gaps between planes (padding to CALIB_PAGE) are filled with zeros */
+    for (int i = 0; i < hdr.num_planes; i++)
+    {
+        struct calib_plane * plane = &hdr.planes[i];
+        CHECK(fseek(f, plane->offset, SEEK_SET) == 0, "fseek");
+        CHECK(fwrite(data[i], 1, plane->size, f) == plane->size, "fwrite");
+        free((void *) data[i]);
+    }
+
+    CHECK(fclose(f) == 0, "could not write %s", tmp_filename);
+    CHECK(rename(tmp_filename, out_filename) == 0, "could not rename %s", tmp_filename);
+}
+
+/* --calib-export: verify the checksums, and save the frames from calib-xN.bin as PGM */
+static void calib_export_gain(int gain)
+{
+    calib_store_open(gain);
+    if (!calib_store.map)
+    {
+        return;
+    }
+
+    struct calib_header * hdr = (struct calib_header *) calib_store.map;
+    for (int i = 0; i < hdr->num_planes; i++)
+    {
+        struct calib_plane * plane = &hdr->planes[i];
+        const void * data = calib_store_data(plane);
+        CHECK(hash_buffer(data, plane->size) == plane->checksum, "calib-x%d.bin: checksum mismatch (%.32s)", gain, plane->name);
+
+        if (plane->type != CALIB_PLANE_FRAME)
+        {
+            printf("Verified    : %.32s\n", plane->name);
+        }
+        else if (file_exists(plane->name))
+        {
+            printf("Verified    : %.32s (file exists, not exported)\n", plane->name);
+        }
+        else
+        {
+            int n = plane->width * plane->height;
+            int32_t * frame = malloc(n * sizeof(frame[0]));
+            CHECK(frame, "malloc");
+            for (int k = 0; k < n; k++)
+            {
+                frame[k] = ((const uint16_t *) data)[k];
+            }
+
+            struct raw_info ri = { .width = plane->width, .height = plane->height };
+            save_pgm(plane->name, &ri, frame);
+            free(frame);
+        }
+    }
+
+    calib_store_close();
+}
+
 static void change_ext(char* old, char* new, char* newext, int maxsize)
 {
     snprintf(new, maxsize - strlen(newext), "%s", old);
@@ -1744,6 +4248,93 @@ static void change_ext(char* old, char* new, char* newext, int maxsize)
     strcpy(ext, newext);
 }
 
+/* same image data, with a different height (rows starting at buffer) */
+static void raw_info_set_rows(struct raw_info * raw_info, void * buffer, int height)
+{
+    raw_info->buffer = buffer;
+    raw_info->height = height;
+    raw_info->frame_size = height * raw_info->pitch;
+    raw_info->active_area.y1 = 0;
+    raw_info->active_area.y2 = height;
+    raw_info->jpeg.y = 0;
+    raw_info->jpeg.height = height;
+}
+
+/* packed row, all pixels set to the same value (at the output bit depth) */
+static void fill_raw_row(struct raw_info * raw_info, uint8_t * row, int value)
+{
+    if (raw_info->bits_per_pixel == 16)
+    {
+        for (int x = 0; x < raw_info->width; x++)
+        {
+            ((uint16_t *) row)[x] = value;
+        }
+        return;
+    }
+
+    int16_t row16[raw_info->width];
+    for (int x = 0; x < raw_info->width; x++)
+    {
+        row16[x] = value << (15 - raw_info->bits_per_pixel);
+    }
+
+    /* exact values have no fractional part, so dithering does not change them */
+    pack_row(raw_info, row16, row, 0, 0);
+}
+
+/**
+ * Multi-window readout: the Y windows are stored one after another, in readout order.
+ * Save them either as separate DNGs, or stitched at their positions on the sensor.
+ */
+static void save_dng_windows(char * out_filename, struct raw_info * raw_info, struct frame_geometry * geom,
+                             int num_windows, int * first, int * count)
+{
+    uint8_t * buffer = raw_info->buffer;
+
+    /* not on the stack: the DNG header code stores the addresses of raw_info fields as int */
+    static struct raw_info out_info;
+    out_info = *raw_info;
+
+    if (window_output == 1)
+    {
+        for (int k = 0; k < num_windows; k++)
+        {
+            char suffix[16];
+            char filename[256];
+            snprintf(suffix, sizeof(suffix), "-w%d.DNG", k + 1);
+            change_ext(out_filename, filename, suffix, sizeof(filename));
+
+            raw_info_set_rows(&out_info, buffer + first[k] * raw_info->pitch, count[k]);
+            printf("Output file : %s (Y window %d)\n", filename, k + 1);
+            save_dng(filename, &out_info);
+        }
+        return;
+    }
+
+    int pos[MAX_Y_WINDOWS];
+    int height = frame_geometry_stitch(geom, num_windows, count, pos);
+
+    uint8_t * out = malloc(height * raw_info->pitch);
+    CHECK(out, "malloc");
+    raw_info_set_rows(&out_info, out, height);
+
+    /* gaps are black */
+    fill_raw_row(raw_info, out, raw_info->black_level);
+    for (int y = 1; y < height; y++)
+    {
+        memcpy(out + y * raw_info->pitch, out, raw_info->pitch);
+    }
+
+    for (int k = 0; k < num_windows; k++)
+    {
+        memcpy(out + pos[k] * raw_info->pitch, buffer + first[k] * raw_info->pitch, count[k] * raw_info->pitch);
+    }
+
+    printf("Output file : %s (%d windows, %d rows)\n", out_filename, num_windows, height);
+    save_dng(out_filename, &out_info);
+    free(out);
+}
+
 int main(int argc, char** argv)
 {
     if (argc == 1)
@@ -1781,6 +4372,7 @@ int main(int argc, char** argv)
         printf("        raw2dng --calc-clipframe *-gainx1-*.raw12 \n");
         printf(" - Always compute these frames in the order listed here\n");
         printf("   (dark/dcnu frames, then gain frames (optional), then clip frames (optional).\n");
+        printf(" - Input files may have mixed gains (one set of reference images per gain).\n");
 
         printf("\n");
         show_commandline_help(argv[0]);
@@ -1793,13 +4385,49 @@ int main(int argc, char** argv)
             parse_commandline_option(argv[k]);
     show_active_options();
 
+    parallel_set_threads(num_threads);
+
+    if (calib_pack || calib_export)
+    {
+        /* no input files needed */
+        for (int g = 1; g < CALIB_GAINS; g++)
+        {
+            if (calib_pack) calib_pack_gain(g);
+            else calib_export_gain(g);
+        }
+
+        printf("Done.\n\n");
+        return 0;
+    }
+
+    if (calc_darkall)
+    {
+        /* the linear fit drives everything else (dark frame output, no dark frame correction) */
+        calc_dcnuframe = 1;
+        CHECK(!calc_darkframe && !calc_gainframe && !calc_clipframe, "--calc-darkall can't be combined with other --calc options");
+        CHECK(!calib_checkpoint, "--checkpoint does not work with --calc-darkall");
+    }
+
+    CHECK(!robust_stack || calc_darkframe || calc_darkall, "--median-stack and --sigma-stack require --calc-darkframe or --calc-darkall");
+    CHECK(!robust_stack || !calib_checkpoint, "--checkpoint does not work with --median-stack or --sigma-stack");
+
+    CHECK(!window_output || (!dng_gainmap && fix_bad_pixels != 2),
+          "--split-windows and --stitch-windows do not work with --dng-gainmap or --dng-badpix");
+
     int pixel_extract = (pixel_extract_xy[0] >= 0) && (pixel_extract_xy[1] >= 0);
 
     char dark_filename[20];
     char dcnu_filename[20];
+    char hotpix_filename[20];
+    char badpix_filename[20];
+    int * dng_bad_pixels = 0;
+    static uint16_t linearization_table[4096];     /* 12-bit input (or fewer) */
     char gain_filename[20];
     char clip_filename[20];
     char lut_filename[20];
+    char ckpt_filename[20];
+    char darkavg_filename[20];
+    char report_filename[20];
 
     /* all other arguments are input or output files */
     for (int k = 1; k < argc; k++)
@@ -1817,6 +4445,7 @@ int main(int argc, char** argv)
         {
             fi = fopen(argv[k], "rb");
             CHECK(fi, "could not open %s", argv[k]);
+            prefetch_next_input(argc, argv, k);
 
             /* replace input file extension with .DNG */
             change_ext(argv[k], out_filename, ".DNG", sizeof(out_filename));
@@ -1869,17 +4498,26 @@ int main(int argc, char** argv)
         int width = image_width ? image_width : hdmi_ramdump ? 1920*2 : 4096;
         int height = image_height;
 
+        /* PGM input is repacked as 12-bit, unless requested otherwise */
+        int bits = input_bits ? input_bits :
+                   (fi != stdin && !pgm_input && !hdmi_ramdump) ? detect_bit_depth(fi, width, height) : 12;
+        CHECK(bits == 12 || bits == 10 || bits == 8, "unsupported bit depth: %d", bits);
+        CHECK(bits == 12 || !hdmi_ramdump, "HDMI input must be 12-bit");
+        CHECK(width % (bits == 10 ? 4 : 2) == 0, "image width must be a multiple of %d", bits == 10 ? 4 : 2);
+        raw_info.bits_per_pixel = bits;
+
         if (!height)
         {
             /* autodetect height from file size, if not specified in the command line */
             fseek(fi, 0, SEEK_END);
-            height = ftell(fi) / (width * 12 / 8);
+            height = ftell(fi) / (width * bits / 8);
             fseek(fi, 0, SEEK_SET);
         }
         raw_set_geometry(width, height, 0, 0, 0, 0);
 
         /* print current settings */
         printf("Resolution  : %d x %d\n", raw_info.width, raw_info.height);
+        printf("Bit depth   : %d\n", raw_info.bits_per_pixel);
         printf("Frame size  : %d bytes\n", raw_info.frame_size);
 
         if (bayer_order) {
@@ -1914,6 +4552,9 @@ int main(int argc, char** argv)
                 break;
         }
 
+        /* restored after each file */
+        int cfa_pattern = raw_info.cfa_pattern;
+
         /* raw12 data */
         raw_info.buffer = malloc(raw_info.frame_size);
         CHECK(raw_info.buffer, "malloc");
@@ -1929,8 +4570,8 @@ int main(int argc, char** argv)
 
         int meta_gain = 0;
         float meta_expo = 0;
-        int meta_ystart = 0;
-        int meta_ysize = 0;
+        float meta_expo2 = 0;
+        struct frame_geometry geom = { .xstart = image_xstart };
         int meta_black_col = 1;     /* assume black columns are enabled */
 
         if (gain)
@@ -1948,9 +4589,11 @@ int main(int argc, char** argv)
         /* attempt to read the metadata block */
         /* if not present, assume no metadata and print a warning */
         uint16_t registers[128];
+        int has_metadata = 0;
         int r = fread(registers, 1, 256, fi);
         if (r == 256)
         {
+            has_metadata = 1;
             /* the metadata block should be the last thing in the file */
             /* expecting this call to fail; in that case, it shouldn't modify our output buffer */
             CHECK(fread(registers, 1, 1, fi) == 0, "unexpected bytes after metadata block");
@@ -1958,8 +4601,10 @@ int main(int argc, char** argv)
 
             meta_gain = metadata_get_gain(registers);
             meta_expo = metadata_get_exposure(registers);
-            meta_ystart = metadata_get_ystart(registers);
-            meta_ysize = metadata_get_ysize(registers);
+            meta_expo2 = metadata_get_exposure2(registers);
+            geom.num_windows = metadata_get_windows(registers, geom.ystart, geom.ysize);
+            geom.sub = metadata_get_subsampling(registers, &geom.sub_offset, &geom.sub_step);
+            geom.bin = metadata_get_binning(registers);
             meta_black_col = metadata_get_black_col(registers);
 
             if (dump_regs)
@@ -1980,6 +4625,17 @@ int main(int argc, char** argv)
             }
         }
 
+        int win_first[MAX_Y_WINDOWS];
+        int win_count[MAX_Y_WINDOWS];
+        int num_windows = frame_geometry_windows(&geom, raw_info.height, win_first, win_count);
+
+        /* the Bayer order above is for full-resolution readout */
+        raw_info.cfa_pattern = frame_geometry_cfa(&geom, cfa_pattern);
+        if (raw_info.cfa_pattern != cfa_pattern)
+        {
+            printf("Bayer shift : readout starts at an odd row or column\n");
+        }
+
         if (hdmi_ramdump && black_level == 0xFFFF)
         {
             /* in the HDMI experiment, there were no black reference columns enabled */
@@ -2001,7 +4657,7 @@ int main(int argc, char** argv)
              */
             int offset = -raw_info.black_level;     /* positive number */
             printf("Raw offset  : %d\n", offset);
-            raw12_data_offset(raw_info.buffer, raw_info.frame_size, offset);
+            raw_data_offset(&raw_info, offset);
             raw_info.black_level = 0;
             raw_info.white_level = MIN(raw_info.white_level + offset, 4095);
         }
@@ -2015,7 +4671,7 @@ int main(int argc, char** argv)
         if (swap_lines)
         {
             printf("Line swap...\n");
-            reverse_lines_order(raw_info.buffer, raw_info.frame_size, raw_info.width);
+            reverse_lines_order(raw_info.buffer, raw_info.frame_size, raw_info.pitch);
         }
 
         if (no_processing)
@@ -2026,9 +4682,38 @@ int main(int argc, char** argv)
 
         snprintf(dark_filename, sizeof(dark_filename), "darkframe-x%d.pgm", meta_gain);
         snprintf(dcnu_filename, sizeof(dcnu_filename), "dcnuframe-x%d.pgm", meta_gain);
+        snprintf(hotpix_filename, sizeof(hotpix_filename), "hotpixels-x%d.txt", meta_gain);
+        snprintf(badpix_filename, sizeof(badpix_filename), "badpixels-x%d.txt", meta_gain);
         snprintf(gain_filename, sizeof(gain_filename), "gainframe-x%d.pgm", meta_gain);
         snprintf(clip_filename, sizeof(clip_filename), "clipframe-x%d.pgm", meta_gain);
         snprintf(lut_filename,  sizeof(lut_filename),  "lut-x%d.spi1d",     meta_gain);
+        checkpoint_filename(ckpt_filename, sizeof(ckpt_filename), meta_gain);
+
+        /* calib-xN.bin, if present, replaces the individual files */
+        calib_store_open(meta_gain);
+
+        if (calc_darkframe || calc_dcnuframe || calc_gainframe || calc_clipframe)
+        {
+            /* each gain setting has its own accumulators */
+            calib_select_gain(meta_gain);
+        }
+
+        if (calib_checkpoint && (calc_darkframe || calc_dcnuframe || calc_gainframe || calc_clipframe))
+        {
+            /* loaded with the first input file for each gain (we need its resolution) */
+            if (!calib_frames->loaded)
+            {
+                checkpoint_load(ckpt_filename, &raw_info, meta_gain);
+                calib_frames->loaded = 1;
+            }
+
+            if (calib_frames_find(argv[k]))
+            {
+                printf("Checkpoint  : already included, skipping\n");
+                free(raw16); raw16 = 0;
+                goto cleanup;
+            }
+        }
 
         /* note: gain frame, clip frame and black column subtraction
          * are only enabled if we also use a dark frame */
@@ -2038,25 +4723,113 @@ int main(int argc, char** argv)
         int use_dcnuframe = !calc_dcnuframe && !calc_darkframe && use_darkframe &&
                             !no_dcnuframe && meta_gain && file_exists_warn(dcnu_filename);
 
-        int use_gainframe = !calc_gainframe && !calc_dcnuframe && !calc_darkframe && use_darkframe &&
+        int use_gainmap = dng_gainmap && !calc_gainframe && !calc_dcnuframe && !calc_darkframe && !calc_clipframe &&
+                          !no_gainframe && meta_gain && file_exists_warn(gain_filename);
+
+        int use_gainframe = !use_gainmap && !calc_gainframe && !calc_dcnuframe && !calc_darkframe && use_darkframe &&
                             !no_gainframe && meta_gain && file_exists_warn(gain_filename);
 
         int use_clipframe = !calc_clipframe && !calc_gainframe && !calc_dcnuframe && !calc_darkframe && use_darkframe &&
                             !no_clipframe && meta_gain && file_exists_warn(clip_filename);
 
-        use_lut = use_lut && file_exists_warn(lut_filename);
+        int use_badpix = fix_bad_pixels && !calc_gainframe && !calc_dcnuframe && !calc_darkframe &&
+                         meta_gain && file_exists_warn(badpix_filename);
+
+        /* interleaved dual exposure: merged into a 16-bit image after all other processing */
+        /* dark current is scaled with Exp_time only */
+        int dual_expo = meta_expo2 > 0 && meta_expo > 0 && meta_expo2 != meta_expo && !no_dual_expo &&
+                        !calc_darkframe && !calc_dcnuframe && !calc_gainframe && !calc_clipframe;
+
+        if (dual_expo)
+        {
+            float ratio = MAX(meta_expo, meta_expo2) / MIN(meta_expo, meta_expo2);
+            printf("Dual expo   : ratio %.2f (+%.1f EV), 16-bit output\n", ratio, log2(ratio));
+        }
+
+        /* multi-slope (PLR) exposures are linearized with a LUT built from the register values */
+        /* not for calibration frames or dark frame checks: these must stay in raw sensor units */
+        struct compiled_lut * plr_lut = (has_metadata && !no_plr && !check_darkframe &&
+            !calc_darkframe && !calc_dcnuframe && !calc_gainframe && !calc_clipframe)
+            ? plr_lut_get(registers, &raw_info) : 0;
+
+        if (use_lut && !plr_lut && !file_exists_warn(lut_filename))
+        {
+            use_lut = 0;
+        }
+
+        /* with --dng-lut, the LUT is stored as metadata, if possible */
+        int lut_in_dng = 0;
+        struct compiled_lut * lut = plr_lut;
+
+        if (use_lut && !plr_lut)
+        {
+            /* no newline here (load_lut will print more info) */
+            printf("LUT file    : %s ", lut_filename);
+            load_lut(lut_filename, meta_gain);
+            lut = compiled_lut;
+        }
+
+        if (lut)
+        {
+            if (use_lut == 2 && dual_expo)
+            {
+                /* the LUT applies to each exposure, before merging */
+                printf("LUT in DNG  : not possible with dual exposure\n");
+            }
+            else if (use_lut == 2 && output_16bit)
+            {
+                printf("LUT in DNG  : not possible with 16-bit output\n");
+            }
+            else if (use_lut == 2 && lut->components == 1)
+            {
+                /* LinearizationTable: 12-bit input (or 10/8); output scaled to 16 bits (LUT output is 15-bit)
+                 * black and white levels apply to the linearized values */
+                int table_size = 1 << raw_info.bits_per_pixel;
+                for (int i = 0; i < table_size; i++)
+                {
+                    linearization_table[i] = lut_lookup(lut->lut[0][0], i << (15 - raw_info.bits_per_pixel)) * 2;
+                }
+                dng_set_linearization_table(linearization_table, table_size,
+                    raw_info.black_level * 16, raw_info.white_level * 16
+                );
+                lut_in_dng = 1;
+            }
+            else if (use_lut == 2)
+            {
+                printf("LUT in DNG  : not possible with %d components\n", lut->components);
+            }
+        }
+
+        int apply_lut_to_pixels = lut && !lut_in_dng;
+
+        /* black reference columns: 8 at each side of the sensor,
+         * fewer (or none) with horizontal crop, subsampling or binning */
+        black_columns_update(&geom, raw_info.width,
+            use_darkframe ? reference_frame_view(dark_filename, &raw_info, &geom)->full_width : 0
+        );
+
+        if (use_gainmap)
+        {
+            printf("Gain map    : %s\n", gain_filename);
+            gain_map_load(&raw_info, gain_filename, &geom);
+            dng_set_opcode_list2(gain_map.opcodes, gain_map.size);
+        }
 
         if (!use_darkframe && !calc_darkframe && !calc_dcnuframe)
         {
             no_blackcol = 1;
         }
 
-        /* check whether black reference columns were enabled in sensor configuration */
-        if (!meta_black_col)
+        /* check whether black reference columns were enabled in sensor configuration, and read out */
+        if (!meta_black_col || (!black_cols.left && !black_cols.right))
         {
             printf("Black refcol: not present\n");
             no_blackcol = 1;
         }
+        else if (black_cols.left != BLACK_COLUMNS || black_cols.right != BLACK_COLUMNS)
+        {
+            printf("Black refcol: %s (%d left, %d right)\n", no_blackcol ? "ignored" : "enabled", black_cols.left, black_cols.right);
+        }
         else
         {
             printf("Black refcol: %s\n", no_blackcol ? "ignored" : "enabled");
@@ -2065,7 +4838,7 @@ int main(int argc, char** argv)
         int raw16_postprocessing = (raw16 ||
              calc_darkframe || calc_dcnuframe || calc_gainframe || calc_clipframe ||
              use_darkframe  || use_gainframe  || use_clipframe  || check_darkframe ||
-             use_lut || fixpn || pixel_extract);
+             apply_lut_to_pixels || fixpn || pixel_extract || (use_badpix && fix_bad_pixels == 1) || dual_expo || output_16bit);
 
         if (raw16_postprocessing && !raw16)
         {
@@ -2073,28 +4846,43 @@ int main(int argc, char** argv)
             /* this also multiplies the values by 8 */
             /* but if the input file is already raw16, nothing to do here */
             raw16 = malloc(raw_info.width * raw_info.height * sizeof(raw16[0]));
-            unpack12(&raw_info, raw16);
+            unpack_raw(&raw_info, raw16);
+        }
+
+        /* without black column subtraction, the gain frame can be applied
+         * in the same pass as the dark frame (flat field correction in one pass) */
+        int fuse_gainframe = use_gainframe && use_darkframe && no_blackcol;
+        const uint16_t * gain = 0;
+
+        if (use_gainframe)
+        {
+            printf("Gain frame  : %s\n", gain_filename);
+            gain = gain_frame_load(&raw_info, gain_filename, &geom);
         }
 
         if (use_darkframe)
         {
             printf("Dark frame  : %s\n", dark_filename);
-            int16_t * dark = malloc(raw_info.width * raw_info.height * sizeof(dark[0]));
-            int16_t * darkcurrent = 0;
             float darkcurrent_scaling = 0;
             int extra_offset = 0;
 
-            read_reference_frame(dark_filename, dark, &raw_info, meta_ystart, meta_ysize);
+            dark_engine_load(&raw_info, dark_filename, use_dcnuframe ? dcnu_filename : 0, &geom);
 
             if (use_dcnuframe)
             {
+                if (dc_hot_pixels)
+                {
+                    hot_pixels_load(hotpix_filename, dcnu_filename, &raw_info, &geom);
+                }
+
                 printf("Dark current: %s ", dcnu_filename);
-                darkcurrent = malloc(raw_info.width * raw_info.height * sizeof(darkcurrent[0]));
-                read_reference_frame(dcnu_filename, darkcurrent, &raw_info, meta_ystart, meta_ysize);
+                darkcurrent_scaling = meta_expo;
 
-                darkcurrent_scaling =
-                    (dc_hot_pixels) ? measure_hot_pixels(&raw_info, raw16, darkcurrent)
-                                    : meta_expo ;
+                if (dc_hot_pixels)
+                {
+                    float scaling = measure_hot_pixels(&raw_info, raw16);
+                    if (isfinite(scaling)) darkcurrent_scaling = scaling;
+                }
 
                 printf("x %.1f\n", darkcurrent_scaling);
             }
@@ -2105,33 +4893,81 @@ int main(int argc, char** argv)
                 extra_offset = dark_current;
             }
 
-            subtract_dark_frame(&raw_info, raw16, dark, extra_offset, darkcurrent, darkcurrent_scaling);
-            free(dark);
-            if (darkcurrent) free(darkcurrent);
+            subtract_dark_frame(&raw_info, raw16, darkcurrent_scaling, extra_offset, fuse_gainframe ? gain : 0);
         }
 
+        /* robust stacking needs to know the black column offsets, to apply them again */
+        int * row_offsets = 0;
+
         if (!no_blackcol)
         {
-            subtract_black_columns(&raw_info, raw16);
+            if (robust_stack && (calc_darkframe || calc_darkall))
+            {
+                row_offsets = malloc(2 * raw_info.height * sizeof(row_offsets[0]));
+                CHECK(row_offsets, "malloc");
+            }
+            for (int k = 0; k < num_windows; k++)
+            {
+                /* rows from different windows are not adjacent on the sensor,
+                 * so each window has its own row noise correction */
+                struct raw_info window = raw_info;
+                window.height = win_count[k];
+                subtract_black_columns(&window, raw16 + win_first[k] * raw_info.width,
+                    row_offsets ? row_offsets + 2 * win_first[k] : 0);
+            }
         }
 
         if (use_gainframe)
         {
-            printf("Gain frame  : %s\n", gain_filename);
-            uint16_t * gain = malloc(raw_info.width * raw_info.height * sizeof(gain[0]));
-            read_reference_frame(gain_filename, (int16_t*) gain, &raw_info, meta_ystart, meta_ysize);
-            apply_gain_frame(&raw_info, raw16, gain);
-            free(gain);
+            if (!fuse_gainframe)
+            {
+                apply_gain_frame(&raw_info, raw16, gain);
+            }
         }
 
         if (use_clipframe)
         {
             /* note: when computing the clip frame, you should also apply dark and gain frames to it */
             printf("Clip frame  : %s\n", clip_filename);
-            uint16_t * clip = malloc(raw_info.width * raw_info.height * sizeof(clip[0]));
-            read_reference_frame(clip_filename, (int16_t*) clip, &raw_info, meta_ystart, meta_ysize);
-            apply_clip_frame(&raw_info, raw16, clip);
-            free(clip);
+            clip_frame_load(&raw_info, clip_filename, &geom);
+            apply_clip_frame(&raw_info, raw16);
+        }
+
+        if (use_badpix)
+        {
+            /* the list is loaded only once, and reused for all frames with the same geometry */
+            static struct bad_pixel_list bad_pixels;
+            static struct ref_key bad_pixels_key;
+            if (ref_key_update(&bad_pixels_key, badpix_filename, &raw_info, &geom))
+            {
+                int w, h;
+                CHECK(badpix_read(badpix_filename, &bad_pixels, &w, &h),
+                      "invalid %s", badpix_filename);
+
+                /* full-resolution coordinates to image coordinates */
+                struct frame_view * view = frame_view_get(badpix_filename, &raw_info, &geom, w, h);
+                badpix_remap(&bad_pixels, view->row_inv, view->col_inv, w, h);
+            }
+
+            printf("Bad pixels  : %s (%d)\n", badpix_filename, bad_pixels.count);
+
+            if (fix_bad_pixels == 1)
+            {
+                badpix_fix(&bad_pixels, raw16, raw_info.width, raw_info.height);
+            }
+            else
+            {
+                /* x,y pairs for the DNG */
+                free(dng_bad_pixels);
+                dng_bad_pixels = malloc(2 * MAX(bad_pixels.count, 1) * sizeof(dng_bad_pixels[0]));
+                CHECK(dng_bad_pixels, "malloc");
+                for (int i = 0; i < bad_pixels.count; i++)
+                {
+                    dng_bad_pixels[2*i]   = bad_pixels.pixels[i].x;
+                    dng_bad_pixels[2*i+1] = bad_pixels.pixels[i].y;
+                }
+                dng_set_bad_pixels(dng_bad_pixels, bad_pixels.count);
+            }
         }
 
         if (fixpn)
@@ -2147,17 +4983,19 @@ int main(int argc, char** argv)
             }
         }
 
-        if (use_lut)
+        /* the LUT can be applied while packing the output,
+         * unless some other step needs the LUT'ed data */
+        int fuse_lut = apply_lut_to_pixels && !check_darkframe && !pixel_extract && !dual_expo &&
+                       !calc_darkframe && !calc_dcnuframe && !calc_gainframe && !calc_clipframe;
+
+        if (apply_lut_to_pixels && !fuse_lut)
         {
-            /* no newline here (read_lut will print more info) */
-            printf("LUT file    : %s ", lut_filename);
-            read_lut(lut_filename);
-            apply_lut(&raw_info, raw16);
+            apply_lut(&raw_info, raw16, lut);
         }
 
         if (calc_darkframe || calc_dcnuframe || calc_gainframe || calc_clipframe)
         {
-            //if (meta_ystart || raw_info.height != 3072)
+            //if (geom.ystart[0] || raw_info.height != 3072)
             //{
             //    printf("Error: calibration frames must be full-resolution.\n");
             //    exit(1);
@@ -2180,10 +5018,31 @@ int main(int argc, char** argv)
                 /* linear fit for multiple frames */
                 calc_linfitframes_addframe(&raw_info, raw16, meta_gain, meta_expo);
             }
-            else
+
+            if (!calc_dcnuframe || calc_darkall)
             {
+                /* robust stacking reads the raw data again, so it must be unmodified */
+                CHECK(!robust_stack || (endswith(argv[k], ".raw12") && !hdmi_ramdump && !swap_lines && black_level >= 0),
+                      "robust stacking requires unmodified .raw12 input files");
+
                 /* generic averaging routine */
-                calc_avgframe_addframe(&raw_info, raw16, meta_gain, meta_expo);
+                calc_avgframe_addframe(&raw_info, raw16, meta_gain, meta_expo, argv[k], row_offsets);
+            }
+
+            if (calc_darkall)
+            {
+                /* quality indicators, from the same data */
+                check_darkframe_iq(&raw_info, raw16, &A->iq[A->count - 1]);
+            }
+
+            if (calib_checkpoint)
+            {
+                calib_frames_add(argv[k]);
+
+                if (calib_frames->count - calib_frames->saved >= CHECKPOINT_INTERVAL)
+                {
+                    checkpoint_save(ckpt_filename, &raw_info);
+                }
             }
 
             /* no need to repack to 12 bits */
@@ -2193,12 +5052,12 @@ int main(int argc, char** argv)
 
         if (check_darkframe)
         {
-            check_darkframe_iq(&raw_info, raw16);
+            check_darkframe_iq(&raw_info, raw16, 0);
         }
 
         if (raw16_postprocessing)
         {
-            check_levels(&raw_info, raw16);
+            check_levels(&raw_info, raw16, fuse_lut ? lut : 0);
         }
 
         if (pixel_extract)
@@ -2234,45 +5093,141 @@ int main(int argc, char** argv)
             goto cleanup;
         }
 
-        if (raw16_postprocessing)
+        if (dual_expo)
+        {
+            /* the 16-bit output replaces the raw buffer (no copy) */
+            float ratio = MAX(meta_expo, meta_expo2) / MIN(meta_expo, meta_expo2);
+            merge_dual_exposure(&raw_info, raw16, ratio, meta_expo < meta_expo2);
+            raw_info_use_raw16(&raw_info, raw16); raw16 = 0;
+            raw_info.black_level *= 16;
+            raw_info.white_level = 65535;
+        }
+        else if (output_16bit)
+        {
+            /* processing done, save the 16-bit data as it is (12-bit x 8) */
+            finish_raw16(&raw_info, raw16, fuse_lut ? lut : 0);
+            raw_info_use_raw16(&raw_info, raw16); raw16 = 0;
+            raw_info.black_level *= 8;
+            raw_info.white_level *= 8;
+        }
+        else if (raw16_postprocessing)
         {
-            /* processing done, repack the 16-bit data into 12-bit raw buffer */
-            pack12(&raw_info, raw16);
+            /* processing done, repack the 16-bit data into the raw buffer (12, 10 or 8-bit) */
+            pack_raw(&raw_info, raw16, fuse_lut ? lut : 0);
             free(raw16); raw16 = 0;
         }
 
 save_output:
+        if (raw_info.bits_per_pixel < 12)
+        {
+            /* black and white levels are 12-bit values (16-bit output sets its own); the DNG uses the bit depth of the raw data
+             * (with a LinearizationTable, the linearized levels are used instead) */
+            raw_info.black_level >>= 12 - raw_info.bits_per_pixel;
+            raw_info.white_level >>= 12 - raw_info.bits_per_pixel;
+        }
+
         /* save the DNG */
-        printf("Output file : %s\n", out_filename);
-        save_dng(out_filename, &raw_info);
+        if (window_output && num_windows > 1)
+        {
+            save_dng_windows(out_filename, &raw_info, &geom, num_windows, win_first, win_count);
+        }
+        else
+        {
+            printf("Output file : %s\n", out_filename);
+            save_dng(out_filename, &raw_info);
+        }
+        dng_set_bad_pixels(0, 0);
+        dng_set_linearization_table(0, 0, 0, 0);
+        dng_set_opcode_list2(0, 0);
 
 cleanup:
+        raw_info.cfa_pattern = cfa_pattern;
         if (fi != stdin) fclose(fi);
         free(raw_info.buffer); raw_info.buffer = 0;
     }
 
-    if (calc_darkframe)
+    /* calibration frames are computed for each gain setting found in the input files */
+    for (int i = 0; i < calib_num_slots; i++)
     {
-        calc_avgframe_finish(dark_filename, &raw_info, CALC_DARK_FRAME);
+        int g = calib_slot_gains[i];
+        calib_select_gain(g);
 
-        if (file_exists(dcnu_filename))
+        if (!A->count && !L->count)
         {
-            printf("Removing %s...\n", dcnu_filename);
-            unlink(dcnu_filename);
+            continue;
+        }
+
+        int n = raw_info.width * raw_info.height;
+        CHECK((!A->count || A->size == n * (int) sizeof(A->sum32[0])) && (!L->count || L->size == n),
+              "all frames must have the same resolution.");
+
+        snprintf(dark_filename, sizeof(dark_filename), "darkframe-x%d.pgm", g);
+        snprintf(dcnu_filename, sizeof(dcnu_filename), "dcnuframe-x%d.pgm", g);
+        snprintf(hotpix_filename, sizeof(hotpix_filename), "hotpixels-x%d.txt", g);
+        snprintf(badpix_filename, sizeof(badpix_filename), "badpixels-x%d.txt", g);
+        snprintf(gain_filename, sizeof(gain_filename), "gainframe-x%d.pgm", g);
+        snprintf(clip_filename, sizeof(clip_filename), "clipframe-x%d.pgm", g);
+        checkpoint_filename(ckpt_filename, sizeof(ckpt_filename), g);
+
+        printf("\nGain x%d    : %d frames\n", g, MAX(A->count, L->count));
+
+        if (calib_checkpoint && calib_frames->count > calib_frames->saved)
+        {
+            /* before computing the calibration frames (this modifies the accumulators) */
+            checkpoint_save(ckpt_filename, &raw_info);
+        }
+
+        if (calc_darkall)
+        {
+            /* quality report and average frame (bias), then the linear fit (below) */
+            snprintf(report_filename, sizeof(report_filename), "darkcheck-x%d.json", g);
+            snprintf(darkavg_filename, sizeof(darkavg_filename), "darkavg-x%d.pgm", g);
+            save_dark_report(report_filename, g);
+            calc_avgframe_finish(darkavg_filename, badpix_filename, &raw_info, CALC_DARK_FRAME);
+        }
+
+        if (calc_darkframe)
+        {
+            calc_avgframe_finish(dark_filename, badpix_filename, &raw_info, CALC_DARK_FRAME);
+
+            if (file_exists(dcnu_filename))
+            {
+                printf("Removing %s...\n", dcnu_filename);
+                unlink(dcnu_filename);
+            }
+
+            if (file_exists(hotpix_filename))
+            {
+                /* hot pixel index is no longer valid */
+                printf("Removing %s...\n", hotpix_filename);
+                unlink(hotpix_filename);
+            }
+        }
+        else if (calc_dcnuframe)
+        {
+            calc_linfitframes_finish(dark_filename, dcnu_filename, &raw_info);
+
+            if (file_exists(hotpix_filename))
+            {
+                /* hot pixel index is no longer valid */
+                printf("Removing %s...\n", hotpix_filename);
+                unlink(hotpix_filename);
+            }
+        }
+        else if (calc_gainframe)
+        {
+            calc_avgframe_finish(gain_filename, badpix_filename, &raw_info, CALC_GAIN_FRAME);
+        }
+        else if (calc_clipframe)
+        {
+            calc_avgframe_finish(clip_filename, 0, &raw_info, CALC_CLIP_FRAME);
         }
     }
-    else if (calc_dcnuframe)
-    {
-        calc_linfitframes_finish(dark_filename, dcnu_filename, &raw_info);
-    }
-    else if (calc_gainframe)
-    {
-        calc_avgframe_finish(gain_filename, &raw_info, CALC_GAIN_FRAME);
-    }
-    else if (calc_clipframe)
-    {
-        calc_avgframe_finish(clip_filename, &raw_info, CALC_CLIP_FRAME);
-    }
+
+    free(dng_bad_pixels);
+    free_lut();
+    calib_store_close();
+    calib_frames_free();
 
     printf("Done.\n\n");
 